@@ -76,6 +76,32 @@ function _M.Do(dbh, sql, ...)
     return sth:affected()
 end
 
+-- Metatable of parameters made by stream()
+local stream_mt = {
+    __name = 'DBI.Stream'
+}
+
+-- Wraps a large parameter value so that drivers can send it in
+-- pieces rather than as a single string. reader is a function that
+-- returns successive chunks of the value and then nil, or a file,
+-- which is read chunk_size bytes at a time.
+function _M.stream(reader, chunk_size)
+    if type(reader) ~= 'function' then
+        local file = reader
+
+        if type(file) ~= 'userdata' and type(file) ~= 'table' then
+            error(string.format("bad argument #1 to 'stream' (function or file expected, got %s)", type(file)))
+        end
+
+        chunk_size = chunk_size or 65536
+        reader = function()
+            return file:read(chunk_size)
+        end
+    end
+
+    return setmetatable({ reader = reader }, stream_mt)
+end
+
 -- List drivers available on this system
 function _M.Drivers()
     return available_drivers()
@@ -101,6 +101,44 @@ char *dbd_replace_placeholders(lua_State *L, char native_prefix, const char *sql
 	return newsql;
 }
 
+int dbd_is_stream(lua_State *L, int idx) {
+	int is_stream = 0;
+
+	if (lua_istable(L, idx) && lua_getmetatable(L, idx)) {
+		lua_getfield(L, -1, "__name");
+		is_stream = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), DBI_STREAM) == 0;
+		lua_pop(L, 2);
+	}
+
+	return is_stream;
+}
+
+/*
+ * the reader is called protected, so drivers can clean up after it
+ * fails. Returns 0, or 1 with an error message pushed instead.
+ */
+int dbd_stream_read(lua_State *L, int idx) {
+	int type;
+
+	if (idx < 0 && idx > LUA_REGISTRYINDEX)
+		idx = lua_gettop(L) + idx + 1;
+
+	lua_getfield(L, idx, "reader");
+
+	if (lua_pcall(L, 0, 1, 0))
+		return 1;
+
+	type = lua_type(L, -1);
+
+	if (type != LUA_TNIL && type != LUA_TSTRING) {
+		lua_pop(L, 1);
+		lua_pushfstring(L, "stream reader returned a %s", lua_typename(L, type));
+		return 1;
+	}
+
+	return 0;
+}
+
 void dbd_register(lua_State *L, const char *name,
                   const luaL_Reg *methods, const luaL_Reg *class_methods,
                   lua_CFunction gc, lua_CFunction tostring, lua_CFunction close)
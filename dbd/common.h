@@ -10,6 +10,12 @@
 #include <compat-5.1.h>
 #endif
 
+#if LUA_VERSION_NUM < 502
+    #define dbd_rawlen lua_objlen
+#else
+    #define dbd_rawlen lua_rawlen
+#endif
+
 #ifdef _WIN32
     #define LUA_EXPORT __declspec(dllexport)
 #else
@@ -143,6 +149,19 @@ typedef enum lua_push_type {
 #define DBI_ERR_NOT_IMPLEMENTED     "Method %s.%s is not implemented"
 #define DBI_ERR_QUOTING_STR         "Error quoting string: %s"
 #define DBI_ERR_STATEMENT_BROKEN    "Statement unavailable: database closed"
+#define DBI_ERR_ASYNC_PENDING       "Statement has an asynchronous operation in progress"
+#define DBI_ERR_EXECUTE_TIMEOUT     "Execute timed out after %d ms"
+#define DBI_ERR_CURSOR_ROWCOUNT     "Row count unknown for a server side cursor"
+#define DBI_ERR_CANCEL_UNANSWERED   "Execute timed out after %d ms and the cancel went unanswered; the connection is still busy"
+#define DBI_ERR_INVALID_LOB         "Invalid or closed large object handle"
+#define DBI_ERR_OPEN_LOB            "Error opening large object: %s"
+#define DBI_ERR_CREATE_FUNCTION     "Error creating function `%s': %s"
+#define DBI_ERR_BACKUP              "Backup failed: %s"
+
+/*
+ * metatable name of parameters made by DBI.stream()
+ */
+#define DBI_STREAM "DBI.Stream"
 
 /*
  * convert string to lower case
@@ -155,6 +174,16 @@ const char *dbd_strlower(char *in);
  */
 char *dbd_replace_placeholders(lua_State *L, char native_prefix, const char *sql);
 
+/*
+ * true if the value at idx was made by DBI.stream()
+ */
+int dbd_is_stream(lua_State *L, int idx);
+
+/*
+ * push the next chunk of the stream at idx, or nil after the last
+ */
+int dbd_stream_read(lua_State *L, int idx);
+
 void dbd_register(lua_State *L, const char *name,
                   const luaL_Reg *methods, const luaL_Reg *class_methods,
                   lua_CFunction gc, lua_CFunction tostring, lua_CFunction close);
@@ -1,77 +1,647 @@
+#include <limits.h>
+
 #include "dbd_mysql.h"
 
-int dbd_mysql_statement_create(lua_State *L, connection_t *conn, const char *sql_query);
+int dbd_mysql_statement_create(lua_State *L, connection_t *conn, const char *sql_query, int stream, unsigned long prefetch_rows, int epoch, int numeric, int deferred);
 
 /*
- * connection,err = DBD.MySQl.New(dbname, user, password, host, port)
+ * LOAD DATA LOCAL INFILE state, for the duration of a load_data()
  */
-static int connection_new(lua_State *L) {
-	int n = lua_gettop(L);
+typedef struct _infile {
+	lua_State *L;
+	int source;     /* stack index of the data source */
+	int chunk;      /* stack index of the data being sent */
+	size_t offset;  /* bytes of the chunk already sent */
+	int row;        /* next row of a table source */
+	int columns;    /* values per row of a table source, 0 for all */
+	int done;
+	char error[256];
+} infile_t;
 
-	connection_t *conn = NULL;
+/*
+ * error reported for LOCAL INFILE requests (CR_UNKNOWN_ERROR)
+ */
+#define INFILE_ERROR 2000
 
-	const char *host = NULL;
-	const char *user = NULL;
-	const char *password = NULL;
-	const char *db = NULL;
-	int port = 0;
-
-	const char *unix_socket = NULL;
-	int client_flag = 0; /* TODO always 0, set flags from options table */
-
-	/* db, user, password, host, port */
-	switch (n) {
-	case 5:
-		if (lua_isnil(L, 5) == 0)
-			port = luaL_checkinteger(L, 5);
-	// fallthrough
-	case 4:
-		if (lua_isnil(L, 4) == 0)
-			host = luaL_checkstring(L, 4);
-		if (host != NULL) {
-			if (host[0] == '/') {
-				unix_socket = host;
-				host = NULL;
-			};
-		};
-	// fallthrough
-	case 3:
-		if (lua_isnil(L, 3) == 0)
-			password = luaL_checkstring(L, 3);
-	// fallthrough
-	case 2:
-		if (lua_isnil(L, 2) == 0)
-			user = luaL_checkstring(L, 2);
-	// fallthrough
-	case 1:
+static int infile_init(void **ptr, const char *filename, void *userdata) {
+	*ptr = userdata;
+
+	/*
+	 * outside load_data() requests from the server are refused,
+	 * so it can never read arbitrary local files
+	 */
+	return userdata == NULL;
+}
+
+/*
+ * appends value to the buffer in the default LOAD DATA format
+ */
+static void infile_add_value(lua_State *L, luaL_Buffer *b) {
+	const char *s;
+	size_t len;
+	size_t i;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		luaL_addstring(b, "\\N");
+		break;
+	case LUA_TBOOLEAN:
+		s = lua_toboolean(L, -1) ? "1" : "0";
+		lua_pop(L, 1);
+		luaL_addstring(b, s);
+		break;
+	case LUA_TNUMBER:
+		lua_tostring(L, -1);
+		luaL_addvalue(b);
+		break;
+	case LUA_TSTRING:
 		/*
-		 * db is the only mandatory parameter
+		 * still referenced by the row table after the pop
 		 */
-		db = luaL_checkstring(L, 1);
+		s = lua_tolstring(L, -1, &len);
+		lua_pop(L, 1);
+
+		for (i = 0; i < len; i++) {
+			switch (s[i]) {
+			case '\\': luaL_addstring(b, "\\\\"); break;
+			case '\t':  luaL_addstring(b, "\\t"); break;
+			case '\n':  luaL_addstring(b, "\\n"); break;
+			case '\r':  luaL_addstring(b, "\\r"); break;
+			case '\0':  luaL_addstring(b, "\\0"); break;
+			default:    luaL_addchar(b, s[i]);
+			}
+		}
+		break;
+	default:
+		luaL_error(L, DBI_ERR_BINDING_TYPE_ERR, lua_typename(L, lua_type(L, -1)));
+	}
+}
+
+/*
+ * chunk = encode_rows(rows, first, columns)
+ *
+ * Encodes up to DBD_MYSQL_INFILE_ROWS rows from first on as tab
+ * separated lines, or returns nil once there are none left.
+ * Called protected, as errors can not be raised through libmysql.
+ */
+static int infile_encode_rows(lua_State *L) {
+	int first = lua_tointeger(L, 2);
+	int columns = lua_tointeger(L, 3);
+	int last = dbd_rawlen(L, 1);
+	luaL_Buffer b;
+	int r, c, n;
+
+	if (first > last) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (last >= first + DBD_MYSQL_INFILE_ROWS)
+		last = first + DBD_MYSQL_INFILE_ROWS - 1;
+
+	lua_settop(L, 3);
+	lua_pushnil(L); /* 4: the current row */
+
+	luaL_buffinit(L, &b);
+
+	for (r = first; r <= last; r++) {
+		lua_rawgeti(L, 1, r);
+		if (!lua_istable(L, -1))
+			luaL_error(L, "row %d is not a table", r);
+		lua_replace(L, 4);
+
+		n = columns ? columns : (int)dbd_rawlen(L, 4);
+
+		for (c = 1; c <= n; c++) {
+			if (c > 1)
+				luaL_addchar(&b, '\t');
+
+			lua_rawgeti(L, 4, c);
+			infile_add_value(L, &b);
+		}
+
+		luaL_addchar(&b, '\n');
+	}
+
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+ * makes the next piece of the source the current chunk. Returns 0
+ * at the end of the data and -1 on error.
+ */
+static int infile_next_chunk(infile_t *infile) {
+	lua_State *L = infile->L;
+
+	switch (lua_type(L, infile->source)) {
+	case LUA_TSTRING:
+		if (infile->row)
+			return 0;
+
+		infile->row = 1;
+		lua_pushvalue(L, infile->source);
+		break;
+	case LUA_TFUNCTION:
+		lua_pushvalue(L, infile->source);
+		if (lua_pcall(L, 0, 1, 0)) {
+			snprintf(infile->error, sizeof(infile->error), "%s", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return -1;
+		}
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return 0;
+		}
+
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			snprintf(infile->error, sizeof(infile->error), "load_data source returned a %s", luaL_typename(L, -1));
+			lua_pop(L, 1);
+			return -1;
+		}
+		break;
+	default:
+		lua_pushcfunction(L, infile_encode_rows);
+		lua_pushvalue(L, infile->source);
+		lua_pushinteger(L, infile->row);
+		lua_pushinteger(L, infile->columns);
+		if (lua_pcall(L, 3, 1, 0)) {
+			snprintf(infile->error, sizeof(infile->error), "%s", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return -1;
+		}
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return 0;
+		}
+
+		infile->row += DBD_MYSQL_INFILE_ROWS;
+	}
+
+	lua_replace(L, infile->chunk);
+	infile->offset = 0;
+
+	return 1;
+}
+
+static int infile_read(void *ptr, char *buf, unsigned int buf_len) {
+	infile_t *infile = (infile_t *)ptr;
+	lua_State *L = infile->L;
+
+	while (!infile->done) {
+		size_t len;
+		const char *data = lua_tolstring(L, infile->chunk, &len);
+
+		if (data && infile->offset < len) {
+			size_t n = len - infile->offset;
+
+			if (n > buf_len)
+				n = buf_len;
+
+			memcpy(buf, data + infile->offset, n);
+			infile->offset += n;
+
+			return (int)n;
+		}
+
+		switch (infile_next_chunk(infile)) {
+		case 0:
+			infile->done = 1;
+			break;
+		case -1:
+			infile->done = 1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void infile_end(void *ptr) {
+}
+
+static int infile_error(void *ptr, char *error_msg, unsigned int error_msg_len) {
+	infile_t *infile = (infile_t *)ptr;
+
+	snprintf(error_msg, error_msg_len, "%s", infile ? infile->error :
+	         "LOAD DATA LOCAL INFILE is only available through connection:load_data()");
+
+	return INFILE_ERROR;
+}
+
+/*
+ * arguments of New() and NewAsync()
+ */
+typedef struct _connect_params {
+	const char *host;
+	const char *user;
+	const char *password;
+	const char *db;
+	unsigned int port;
+	const char *unix_socket;
+	unsigned long client_flag;
+
+	int compress;
+	unsigned int connect_timeout;   /* seconds, 0 for the default */
+	unsigned int read_timeout;
+	unsigned int write_timeout;
+	int reconnect;                  /* -1 for the default */
+	const char *init_command;
+	int autocommit;
+} connect_params_t;
+
+/*
+ * values of connection options, which are on top of the stack
+ */
+static const char *option_string(lua_State *L, const char *key) {
+	/*
+	 * only strings stay referenced by the options table
+	 */
+	if (lua_type(L, -1) != LUA_TSTRING)
+		luaL_argerror(L, 1, lua_pushfstring(L, "invalid value for `%s'", key));
+
+	return lua_tostring(L, -1);
+}
+
+static unsigned int option_uint(lua_State *L, const char *key) {
+	lua_Integer value;
+
+	if (lua_type(L, -1) != LUA_TNUMBER)
+		luaL_argerror(L, 1, lua_pushfstring(L, "invalid value for `%s'", key));
+
+	value = lua_tointeger(L, -1);
+
+	if (value < 0 || value > UINT_MAX)
+		luaL_argerror(L, 1, lua_pushfstring(L, "invalid value for `%s'", key));
+
+	return (unsigned int)value;
+}
+
+/*
+ * reads the arguments of New() and NewAsync(), which are either
+ * (dbname, user, password, host, port) or a table with those keys
+ * plus
+ *
+ *   compress        - compress the client/server protocol
+ *   connect_timeout - seconds to wait for the connection
+ *   read_timeout    - seconds to wait for each read from the server
+ *   write_timeout   - seconds to wait for each write to the server
+ *   reconnect       - reconnect automatically when the connection
+ *                     is lost, losing any session state, open
+ *                     transaction and every prepared statement.
+ *                     The autocommit mode is kept.
+ *   init_command    - SQL to run on connecting, and reconnecting
+ *   autocommit      - start in autocommit mode
+ *
+ * A host beginning with '/' is the path of a unix socket.
+ */
+static void connection_params(lua_State *L, connect_params_t *params) {
+	int n = lua_gettop(L);
+
+	params->host = NULL;
+	params->user = NULL;
+	params->password = NULL;
+	params->db = NULL;
+	params->port = 0;
+	params->unix_socket = NULL;
+	params->client_flag = CLIENT_MULTI_STATEMENTS | CLIENT_PS_MULTI_RESULTS;
+
+	params->compress = 0;
+	params->connect_timeout = 0;
+	params->read_timeout = 0;
+	params->write_timeout = 0;
+	params->reconnect = -1;
+	params->init_command = NULL;
+	params->autocommit = 0;
+
+	if (lua_istable(L, 1)) {
+		lua_settop(L, 1);
+
+		lua_pushnil(L);
+		while (lua_next(L, 1)) {
+			const char *key;
+
+			if (lua_type(L, -2) != LUA_TSTRING)
+				luaL_argerror(L, 1, "connection options must be strings");
+
+			key = lua_tostring(L, -2);
+
+			if (strcmp(key, "dbname") == 0) {
+				params->db = option_string(L, key);
+			} else if (strcmp(key, "user") == 0) {
+				params->user = option_string(L, key);
+			} else if (strcmp(key, "password") == 0) {
+				params->password = option_string(L, key);
+			} else if (strcmp(key, "host") == 0) {
+				params->host = option_string(L, key);
+			} else if (strcmp(key, "port") == 0) {
+				params->port = option_uint(L, key);
+			} else if (strcmp(key, "compress") == 0) {
+				params->compress = lua_toboolean(L, -1);
+			} else if (strcmp(key, "connect_timeout") == 0) {
+				params->connect_timeout = option_uint(L, key);
+			} else if (strcmp(key, "read_timeout") == 0) {
+				params->read_timeout = option_uint(L, key);
+			} else if (strcmp(key, "write_timeout") == 0) {
+				params->write_timeout = option_uint(L, key);
+			} else if (strcmp(key, "reconnect") == 0) {
+				params->reconnect = lua_toboolean(L, -1);
+			} else if (strcmp(key, "init_command") == 0) {
+				params->init_command = option_string(L, key);
+			} else if (strcmp(key, "autocommit") == 0) {
+				params->autocommit = lua_toboolean(L, -1);
+			} else {
+				luaL_argerror(L, 1, lua_pushfstring(L, "unknown connection option `%s'", key));
+			}
+
+			lua_pop(L, 1);
+		}
+
+		if (!params->db)
+			luaL_argerror(L, 1, "dbname is required");
+	} else {
+		/* db, user, password, host, port */
+		switch (n) {
+		case 5:
+			if (lua_isnil(L, 5) == 0)
+				params->port = luaL_checkinteger(L, 5);
+		// fallthrough
+		case 4:
+			if (lua_isnil(L, 4) == 0)
+				params->host = luaL_checkstring(L, 4);
+		// fallthrough
+		case 3:
+			if (lua_isnil(L, 3) == 0)
+				params->password = luaL_checkstring(L, 3);
 		// fallthrough
+		case 2:
+			if (lua_isnil(L, 2) == 0)
+				params->user = luaL_checkstring(L, 2);
+		// fallthrough
+		case 1:
+			/*
+			 * db is the only mandatory parameter
+			 */
+			params->db = luaL_checkstring(L, 1);
+			// fallthrough
+		}
 	}
 
-	conn = (connection_t *)lua_newuserdata(L, sizeof(connection_t));
+	if (params->host != NULL) {
+		if (params->host[0] == '/') {
+			params->unix_socket = params->host;
+			params->host = NULL;
+		};
+	};
+}
+
+/*
+ * pushes a new connection object with an initialised handle
+ */
+static connection_t *connection_init(lua_State *L, connect_params_t *params) {
+	connection_t *conn = (connection_t *)lua_newuserdata(L, sizeof(connection_t));
+	unsigned int local_infile = 1;
 
 	conn->mysql = mysql_init(NULL);
+	conn->connecting = 0;
+	conn->wait = 0;
+	conn->connect_ref = LUA_NOREF;
+	conn->autocommit = params->autocommit;
+	conn->thread_id = 0;
+
+	luaL_getmetatable(L, DBD_MYSQL_CONNECTION);
+	lua_setmetatable(L, -2);
+
+	if (!conn->mysql) {
+		luaL_error(L, DBI_ERR_CONNECTION_FAILED, "out of memory");
+	}
+
+	/*
+	 * LOCAL INFILE is needed by load_data(), which supplies the
+	 * data itself. Any other request is refused by infile_init().
+	 */
+	mysql_options(conn->mysql, MYSQL_OPT_LOCAL_INFILE, &local_infile);
+	mysql_set_local_infile_handler(conn->mysql, infile_init, infile_read, infile_end, infile_error, NULL);
+
+	if (params->compress)
+		mysql_options(conn->mysql, MYSQL_OPT_COMPRESS, NULL);
+
+	if (params->connect_timeout)
+		mysql_options(conn->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &params->connect_timeout);
+
+	if (params->read_timeout)
+		mysql_options(conn->mysql, MYSQL_OPT_READ_TIMEOUT, &params->read_timeout);
+
+	if (params->write_timeout)
+		mysql_options(conn->mysql, MYSQL_OPT_WRITE_TIMEOUT, &params->write_timeout);
+
+	if (params->reconnect >= 0) {
+		my_bool reconnect = params->reconnect;
+
+		mysql_options(conn->mysql, MYSQL_OPT_RECONNECT, &reconnect);
+	}
+
+	if (params->init_command)
+		mysql_options(conn->mysql, MYSQL_INIT_COMMAND, params->init_command);
 
-	if (!mysql_real_connect(conn->mysql, host, user, password, db, port, unix_socket, client_flag)) {
+	/*
+	 * every session, including those of automatic reconnects, starts
+	 * with autocommit off. dbd_mysql_restore_autocommit() turns it
+	 * on when that is the mode asked for.
+	 */
+	mysql_options(conn->mysql, MYSQL_INIT_COMMAND, "SET autocommit=0");
+
+	return conn;
+}
+
+/*
+ * applies the mode last set by connection:autocommit(), or the
+ * autocommit option, once in each session. An automatic reconnect
+ * starts a new session with a new thread id. Called after any call
+ * which may have reconnected.
+ */
+void dbd_mysql_restore_autocommit(connection_t *conn) {
+	unsigned long thread_id = mysql_thread_id(conn->mysql);
+
+	if (thread_id == conn->thread_id)
+		return;
+
+	conn->thread_id = thread_id;
+
+	if (conn->autocommit)
+		mysql_autocommit(conn->mysql, 1);
+}
+
+/*
+ * connection,err = DBD.MySQl.New(dbname, user, password, host, port)
+ * connection,err = DBD.MySQl.New{dbname=..., compress=..., ...}
+ */
+static int connection_new(lua_State *L) {
+	connection_t *conn = NULL;
+	connect_params_t params;
+
+	connection_params(L, &params);
+	conn = connection_init(L, &params);
+
+	if (!mysql_real_connect(conn->mysql, params.host, params.user, params.password, params.db, params.port, params.unix_socket, params.client_flag)) {
 		lua_pushnil(L);
 		lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, mysql_error(conn->mysql));
 		return 2;
 	}
 
+	dbd_mysql_restore_autocommit(conn);
+
+	return 1;
+}
+
+#ifdef MYSQL_WAIT_READ
+/*
+ * pushes false and the condition an asynchronous operation waits
+ * for, "read" or "write" on connection:socket() or "timeout"
+ */
+int dbd_mysql_push_wait(lua_State *L, int wait) {
+	lua_pushboolean(L, 0);
+
+	if (wait & MYSQL_WAIT_READ)
+		lua_pushstring(L, "read");
+	else if (wait & MYSQL_WAIT_WRITE)
+		lua_pushstring(L, "write");
+	else
+		lua_pushstring(L, "timeout");
+
+	return 2;
+}
+
+/*
+ * the events to resume an operation with, taken to be those it was
+ * waiting for. MariaDB treats a reported timeout as a failure, so
+ * that is only passed on when there was nothing else to wait for.
+ */
+int dbd_mysql_resume_events(int wait) {
+	if (wait & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE | MYSQL_WAIT_EXCEPT))
+		return wait & ~MYSQL_WAIT_TIMEOUT;
+
+	return wait;
+}
+
+static void connect_done(lua_State *L, connection_t *conn) {
+	conn->connecting = 0;
+	conn->wait = 0;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, conn->connect_ref);
+	conn->connect_ref = LUA_NOREF;
+}
+
+/*
+ * connection = DBD.MySQL.NewAsync(dbname, user, password, host, port)
+ * connection = DBD.MySQL.NewAsync{dbname=..., compress=..., ...}
+ *
+ * Starts connecting without blocking, using the MariaDB Connector/C
+ * asynchronous API. Drive the connection with connection:connect_poll()
+ * until it returns true.
+ */
+static int connection_new_async(lua_State *L) {
+	connection_t *conn = NULL;
+	connect_params_t params;
+	MYSQL *ret = NULL;
+	int i;
+
+	connection_params(L, &params);
+	lua_settop(L, 5);
+
 	/*
-	 * by default turn off autocommit
+	 * the arguments are used until the connection completes
 	 */
-	mysql_autocommit(conn->mysql, 0);
+	lua_createtable(L, 5, 0);
+	for (i = 1; i <= 5; i++) {
+		lua_pushvalue(L, i);
+		lua_rawseti(L, -2, i);
+	}
 
-	luaL_getmetatable(L, DBD_MYSQL_CONNECTION);
-	lua_setmetatable(L, -2);
+	conn = connection_init(L, &params);
+	lua_insert(L, -2);
+	conn->connect_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	mysql_options(conn->mysql, MYSQL_OPT_NONBLOCK, 0);
+
+	conn->connecting = 1;
+	conn->wait = mysql_real_connect_start(&ret, conn->mysql, params.host, params.user, params.password, params.db, params.port, params.unix_socket, params.client_flag);
+
+	if (!conn->wait) {
+		connect_done(L, conn);
+
+		if (!ret) {
+			lua_pushnil(L);
+			lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, mysql_error(conn->mysql));
+			return 2;
+		}
+
+		dbd_mysql_restore_autocommit(conn);
+	}
 
 	return 1;
 }
 
+/*
+ * ready,wait = connection:connect_poll()
+ *
+ * Drives a connection opened with DBD.MySQL.NewAsync. Returns true
+ * once the connection is usable, or false and the condition to wait
+ * for: "read" or "write" on connection:socket(), or "timeout".
+ */
+static int connection_connect_poll(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_MYSQL_CONNECTION);
+	MYSQL *ret = NULL;
+
+	if (!conn->mysql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	if (conn->connecting) {
+		conn->wait = mysql_real_connect_cont(&ret, conn->mysql, dbd_mysql_resume_events(conn->wait));
+
+		if (conn->wait)
+			return dbd_mysql_push_wait(L, conn->wait);
+
+		connect_done(L, conn);
+
+		if (!ret) {
+			lua_pushnil(L);
+			lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, mysql_error(conn->mysql));
+			return 2;
+		}
+
+		dbd_mysql_restore_autocommit(conn);
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * fd = connection:socket()
+ *
+ * The socket to wait on for asynchronous operations
+ */
+static int connection_socket(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_MYSQL_CONNECTION);
+
+	if (!conn->mysql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	lua_pushinteger(L, mysql_get_socket(conn->mysql));
+	return 1;
+}
+#endif
+
 /*
  * success = connection:autocommit(on)
  */
@@ -82,6 +652,11 @@ static int connection_autocommit(lua_State *L) {
 
 	if (conn->mysql) {
 		err = mysql_autocommit(conn->mysql, on);
+
+		if (!err) {
+			conn->autocommit = on;
+			conn->thread_id = mysql_thread_id(conn->mysql);
+		}
 	}
 
 	lua_pushboolean(L, !err);
@@ -101,6 +676,9 @@ static int connection_close(lua_State *L) {
 		conn->mysql = NULL;
 	}
 
+	luaL_unref(L, LUA_REGISTRYINDEX, conn->connect_ref);
+	conn->connect_ref = LUA_NOREF;
+
 	lua_pushboolean(L, disconnect);
 	return 1;
 }
@@ -114,12 +692,200 @@ static int connection_commit(lua_State *L) {
 
 	if (conn->mysql) {
 		err = mysql_commit(conn->mysql);
+		dbd_mysql_restore_autocommit(conn);
 	}
 
 	lua_pushboolean(L, !err);
 	return 1;
 }
 
+/*
+ * success,err = connection:exec_script(sql)
+ *
+ * Runs several semicolon separated statements in one round trip,
+ * stopping at the first that fails. Any result sets are discarded.
+ */
+static int connection_exec_script(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_MYSQL_CONNECTION);
+	size_t len;
+	const char *script = luaL_checklstring(L, 2, &len);
+	int status;
+
+	if (!conn->mysql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	status = mysql_real_query(conn->mysql, script, len);
+
+	while (status == 0) {
+		MYSQL_RES *result = mysql_store_result(conn->mysql);
+
+		if (result) {
+			mysql_free_result(result);
+		} else if (mysql_field_count(conn->mysql) != 0) {
+			status = 1;
+			break;
+		}
+
+		/*
+		 * 0 when there is another result, -1 after the last
+		 */
+		status = mysql_next_result(conn->mysql);
+	}
+
+	dbd_mysql_restore_autocommit(conn);
+
+	if (status > 0) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, mysql_error(conn->mysql));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * appends a backquoted, possibly qualified, identifier
+ */
+static void add_identifier(luaL_Buffer *b, const char *name) {
+	luaL_addchar(b, '`');
+
+	for (; *name; name++) {
+		if (*name == '`') {
+			luaL_addstring(b, "``");
+		} else if (*name == '.') {
+			luaL_addstring(b, "`.`");
+		} else {
+			luaL_addchar(b, *name);
+		}
+	}
+
+	luaL_addchar(b, '`');
+}
+
+/*
+ * rows,err = connection:load_data(table, source, [options])
+ *
+ * Bulk loads table with LOAD DATA LOCAL INFILE, without a file.
+ * source is a string of data, a function returning successive
+ * chunks of it and then nil, or an array of row arrays which are
+ * encoded in the default tab separated format.
+ *
+ * options.columns lists the columns the data fills, options.fields
+ * is a FIELDS/LINES clause describing string or function data and
+ * options.replace or options.ignore handle duplicate keys.
+ */
+static int connection_load_data(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_MYSQL_CONNECTION);
+	const char *table = luaL_checkstring(L, 2);
+	int source_type = lua_type(L, 3);
+	const char *fields = NULL;
+	const char *sql;
+	size_t sql_len;
+	int replace = 0;
+	int ignore = 0;
+	int columns = 0;
+	infile_t infile;
+	luaL_Buffer b;
+	int err;
+	int i;
+
+	luaL_argcheck(L, source_type == LUA_TSTRING || source_type == LUA_TFUNCTION || source_type == LUA_TTABLE,
+	              3, "string, function or table expected");
+
+	if (!conn->mysql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	lua_settop(L, 4);
+
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "fields");
+		fields = lua_tostring(L, -1);
+		lua_pop(L, 1); /* still referenced by the options */
+
+		lua_getfield(L, 4, "replace");
+		replace = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "ignore");
+		ignore = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "columns");
+		lua_replace(L, 4);
+
+		if (lua_istable(L, 4))
+			columns = dbd_rawlen(L, 4);
+	}
+
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "LOAD DATA LOCAL INFILE 'dbd-mysql-load-data'");
+
+	if (replace)
+		luaL_addstring(&b, " REPLACE");
+	else if (ignore)
+		luaL_addstring(&b, " IGNORE");
+
+	luaL_addstring(&b, " INTO TABLE ");
+	add_identifier(&b, table);
+
+	if (fields) {
+		luaL_addchar(&b, ' ');
+		luaL_addstring(&b, fields);
+	}
+
+	if (columns) {
+		for (i = 1; i <= columns; i++) {
+			const char *column;
+
+			lua_rawgeti(L, 4, i);
+			column = lua_tostring(L, -1);
+			lua_pop(L, 1);
+
+			if (!column)
+				luaL_error(L, "column names must be strings");
+
+			luaL_addstring(&b, i == 1 ? " (" : ", ");
+			add_identifier(&b, column);
+		}
+
+		luaL_addchar(&b, ')');
+	}
+
+	luaL_pushresult(&b); /* 5 */
+	sql = lua_tolstring(L, 5, &sql_len);
+	lua_pushnil(L);      /* 6: the chunk being sent */
+
+	infile.L = L;
+	infile.source = 3;
+	infile.chunk = 6;
+	infile.offset = 0;
+	infile.row = source_type == LUA_TTABLE;
+	infile.columns = columns;
+	infile.done = 0;
+	infile.error[0] = '\0';
+
+	mysql_set_local_infile_handler(conn->mysql, infile_init, infile_read, infile_end, infile_error, &infile);
+	err = mysql_real_query(conn->mysql, sql, sql_len);
+	dbd_mysql_restore_autocommit(conn);
+	mysql_set_local_infile_handler(conn->mysql, infile_init, infile_read, infile_end, infile_error, NULL);
+
+	if (err) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, mysql_error(conn->mysql));
+		return 2;
+	}
+
+	lua_pushinteger(L, mysql_affected_rows(conn->mysql));
+	return 1;
+}
+
 /*
  * ok = connection:ping()
  */
@@ -129,6 +895,7 @@ static int connection_ping(lua_State *L) {
 
 	if (conn->mysql) {
 		err = mysql_ping(conn->mysql);
+		dbd_mysql_restore_autocommit(conn);
 	}
 
 	lua_pushboolean(L, !err);
@@ -136,13 +903,66 @@ static int connection_ping(lua_State *L) {
 }
 
 /*
- * statement,err = connection:prepare(sql_string)
+ * statement,err = connection:prepare(sql_string, [options])
+ *
+ * options.stream leaves the result set on the server, reading rows
+ * as they are fetched instead of all at execute time. No other
+ * command can run on the connection until every row has been
+ * fetched or the statement is executed again or closed.
+ *
+ * options.prefetch_rows reads through a read only server side
+ * cursor instead, that many rows per round trip. This implies
+ * stream but leaves the connection free for other statements.
+ *
+ * options.datetime = "epoch" returns DATE, DATETIME and TIMESTAMP
+ * columns as seconds since 1970-01-01 UTC, and TIME columns as
+ * seconds, instead of strings.
+ *
+ * options.decimal = "number" returns DECIMAL columns as numbers,
+ * which may lose precision, instead of strings.
+ *
+ * options.deferred lists columns that fetched rows leave out, to be
+ * read piecewise with statement:read_column() or column_chunks().
  */
 static int connection_prepare(lua_State *L) {
 	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_MYSQL_CONNECTION);
+	static const char *const datetime_formats[] = {"string", "epoch", NULL};
+	static const char *const decimal_formats[] = {"string", "number", NULL};
+
+	int stream = 0;
+	lua_Integer prefetch_rows = 0;
+	int epoch = 0;
+	int numeric = 0;
+	int deferred = 0;
+
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "stream");
+		stream = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "prefetch_rows");
+		if (!lua_isnil(L, -1)) {
+			prefetch_rows = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, prefetch_rows > 0, 3, "prefetch_rows must be positive");
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "datetime");
+		epoch = luaL_checkoption(L, -1, "string", datetime_formats);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "decimal");
+		numeric = luaL_checkoption(L, -1, "string", decimal_formats);
+		lua_pop(L, 1);
+
+		lua_settop(L, 3);
+		lua_getfield(L, 3, "deferred");
+		if (lua_istable(L, 4))
+			deferred = 4;
+	}
 
 	if (conn->mysql) {
-		return dbd_mysql_statement_create(L, conn, luaL_checkstring(L, 2));
+		return dbd_mysql_statement_create(L, conn, luaL_checkstring(L, 2), stream, (unsigned long)prefetch_rows, epoch, numeric, deferred);
 	}
 
 	lua_pushnil(L);
@@ -182,6 +1002,7 @@ static int connection_rollback(lua_State *L) {
 
 	if (conn->mysql) {
 		err = mysql_rollback(conn->mysql);
+		dbd_mysql_restore_autocommit(conn);
 	}
 
 	lua_pushboolean(L, !err);
@@ -224,16 +1045,27 @@ int dbd_mysql_connection(lua_State *L) {
 		{"autocommit", connection_autocommit},
 		{"close", connection_close},
 		{"commit", connection_commit},
+#ifdef MYSQL_WAIT_READ
+		{"connect_poll", connection_connect_poll},
+#endif
+		{"exec_script", connection_exec_script},
+		{"load_data", connection_load_data},
 		{"ping", connection_ping},
 		{"prepare", connection_prepare},
 		{"quote", connection_quote},
 		{"rollback", connection_rollback},
+#ifdef MYSQL_WAIT_READ
+		{"socket", connection_socket},
+#endif
 		{"last_id", connection_lastid},
 		{NULL, NULL}
 	};
 
 	static const luaL_Reg connection_class_methods[] = {
 		{"New", connection_new},
+#ifdef MYSQL_WAIT_READ
+		{"NewAsync", connection_new_async},
+#endif
 		{NULL, NULL}
 	};
 
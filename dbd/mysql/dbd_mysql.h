@@ -13,11 +13,47 @@
 #define my_bool bool
 #endif
 
+/*
+ * largest result buffer allocated up front for a string column.
+ * Longer values grow the buffer when they are fetched.
+ */
+#define DBD_MYSQL_PREALLOC_SIZE 4096
+
+/*
+ * rows encoded per read by connection:load_data() with a table source
+ */
+#define DBD_MYSQL_INFILE_ROWS 256
+
+/*
+ * rows sent per multi-row insert by statement:executemany(), and the
+ * most placeholders the server accepts in one statement
+ */
+#define DBD_MYSQL_BATCH_ROWS 100
+#define DBD_MYSQL_MAX_PARAMS 65535
+
+/*
+ * pending asynchronous statement operations
+ */
+#define DBD_MYSQL_ASYNC_NONE    0
+#define DBD_MYSQL_ASYNC_EXECUTE 1
+#define DBD_MYSQL_ASYNC_STORE   2
+#define DBD_MYSQL_ASYNC_FETCH   3
+
+/*
+ * pushes the value in a bound result buffer
+ */
+typedef void (*decoder_t)(lua_State *L, MYSQL_BIND *bind);
+
 /*
  * connection object implementation
  */
 typedef struct _connection {
 	MYSQL *mysql;
+	int connecting;         /* NewAsync() has not completed */
+	int wait;               /* MYSQL_WAIT_* events the connect waits for */
+	int connect_ref;        /* arguments of a pending NewAsync() */
+	int autocommit;         /* mode set by autocommit() */
+	unsigned long thread_id; /* of the session the mode was set in */
 } connection_t;
 
 /*
@@ -26,10 +62,38 @@ typedef struct _connection {
 typedef struct _statement {
 	connection_t *conn;
 	MYSQL_STMT *stmt;
-	MYSQL_RES *metadata;    /* result dataset metadata */
+	MYSQL_RES *metadata;    /* result dataset metadata, kept while
+	                           executes return the same columns */
+	MYSQL_FIELD *fields;    /* of metadata */
+	int cached;             /* metadata and buffers describe the first
+	                           result of execute, for reuse */
+	int has_result;         /* the latest execute succeeded */
 
 	unsigned long *lengths; /* length of retrieved data
 	                                                we have to keep this from bind time to
 	                                                result retrival time */
+	MYSQL_BIND *bind;       /* result buffers, bound at execute time and
+	                           reused for every row */
+	my_bool *is_null;
+	decoder_t *decoders;    /* per column, chosen at bind time, NULL
+	                           for deferred columns */
+	char *deferred;         /* per column of the prepared statement,
+	                           left out of fetched rows */
+	int num_deferred;
+	int num_columns;
+	int stream;             /* rows are left on the server until fetched */
+	int epoch;              /* dates and times decode to seconds */
+	int numeric;            /* DECIMAL decodes to numbers */
+	int async;              /* pending DBD_MYSQL_ASYNC_* operation */
+	int wait;               /* MYSQL_WAIT_* events it waits for */
+	int result;             /* of a step that completed as it started */
+	int named_columns;      /* of a pending fetch_async() */
+	char *insert;           /* sql of an INSERT ... VALUES (...) that
+	                           executemany() can batch, or NULL */
+	size_t values_start;    /* offset and length of its row of values */
+	size_t values_len;
+	MYSQL_STMT *batch;      /* insert repeating the row batch_rows
+	                           times, kept for the next executemany() */
+	int batch_rows;
 } statement_t;
 
@@ -1,32 +1,221 @@
+#include <ctype.h>
+#include <limits.h>
+
 #include "dbd_mysql.h"
 
-static lua_push_type_t mysql_to_lua_push(unsigned int mysql_type) {
-	lua_push_type_t lua_type;
+void dbd_mysql_restore_autocommit(connection_t *conn);
 
-	switch(mysql_type) {
-	case MYSQL_TYPE_NULL:
-		lua_type = LUA_PUSH_NIL;
-		break;
+#ifdef MYSQL_WAIT_READ
+int dbd_mysql_push_wait(lua_State *L, int wait);
+int dbd_mysql_resume_events(int wait);
+#endif
+
+/*
+ * storage for a bound parameter value
+ */
+typedef union _param_value {
+	int boolean;
+	long long integer;
+	double number;
+	unsigned long length;
+} param_value_t;
+
+/*
+ * result decoders, one of which is chosen for each column when a
+ * result set is bound. Each pushes the value in a bound buffer.
+ */
+static void push_longlong(lua_State *L, long long v) {
+	if ((long long)(lua_Integer)v == v)
+		lua_pushinteger(L, (lua_Integer)v);
+	else
+		lua_pushnumber(L, (lua_Number)v);
+}
+
+static void push_ulonglong(lua_State *L, unsigned long long v) {
+	if ((lua_Integer)v >= 0 && (unsigned long long)(lua_Integer)v == v)
+		lua_pushinteger(L, (lua_Integer)v);
+	else
+		lua_pushnumber(L, (lua_Number)v);
+}
+
+static void decode_nil(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushnil(L);
+}
+
+static void decode_int8(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushinteger(L, *(signed char *)bind->buffer);
+}
+
+static void decode_uint8(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushinteger(L, *(unsigned char *)bind->buffer);
+}
+
+static void decode_int16(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushinteger(L, *(short *)bind->buffer);
+}
+
+static void decode_uint16(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushinteger(L, *(unsigned short *)bind->buffer);
+}
+
+static void decode_int32(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushinteger(L, *(int *)bind->buffer);
+}
+
+static void decode_uint32(lua_State *L, MYSQL_BIND *bind) {
+	push_ulonglong(L, *(unsigned int *)bind->buffer);
+}
+
+static void decode_int64(lua_State *L, MYSQL_BIND *bind) {
+	push_longlong(L, *(long long *)bind->buffer);
+}
+
+static void decode_uint64(lua_State *L, MYSQL_BIND *bind) {
+	push_ulonglong(L, *(unsigned long long *)bind->buffer);
+}
+
+static void decode_float(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushnumber(L, *(float *)bind->buffer);
+}
+
+static void decode_double(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushnumber(L, *(double *)bind->buffer);
+}
+
+static void decode_string(lua_State *L, MYSQL_BIND *bind) {
+	lua_pushlstring(L, bind->buffer, *bind->length);
+}
+
+/*
+ * DECIMAL values arrive as text, kept as strings unless the
+ * statement asks for numbers
+ */
+static void decode_decimal(lua_State *L, MYSQL_BIND *bind) {
+	char str[80];
+	unsigned long len = *bind->length;
+
+	if (len >= sizeof(str)) {
+		decode_string(L, bind);
+		return;
+	}
+
+	memcpy(str, bind->buffer, len);
+	str[len] = '\0';
+
+	lua_pushnumber(L, strtod(str, NULL));
+}
+
+static void decode_datetime(lua_State *L, MYSQL_BIND *bind) {
+	MYSQL_TIME *t = bind->buffer;
+	char str[32];
+
+	snprintf(str, sizeof(str), "%d-%02d-%02d %02d:%02d:%02d", t->year, t->month, t->day, t->hour, t->minute, t->second);
+	lua_pushstring(L, str);
+}
+
+static void decode_date(lua_State *L, MYSQL_BIND *bind) {
+	MYSQL_TIME *t = bind->buffer;
+	char str[16];
+
+	snprintf(str, sizeof(str), "%d-%02d-%02d", t->year, t->month, t->day);
+	lua_pushstring(L, str);
+}
+
+static void decode_time(lua_State *L, MYSQL_BIND *bind) {
+	MYSQL_TIME *t = bind->buffer;
+	char str[16];
+
+	snprintf(str, sizeof(str), "%s%02d:%02d:%02d", t->neg ? "-" : "", t->hour, t->minute, t->second);
+	lua_pushstring(L, str);
+}
+
+/*
+ * days since 1970-01-01 in the proleptic Gregorian calendar
+ */
+static long long days_from_civil(long long y, unsigned int m, unsigned int d) {
+	long long era;
+	unsigned int yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned int)(y - era * 400);
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * DATE, DATETIME and TIMESTAMP as seconds since the epoch, taking
+ * the value as UTC. Zero dates have no such value and become nil.
+ */
+static void decode_epoch(lua_State *L, MYSQL_BIND *bind) {
+	MYSQL_TIME *t = bind->buffer;
+	long long seconds;
+
+	if (t->month == 0 || t->day == 0) {
+		lua_pushnil(L);
+		return;
+	}
+
+	seconds = days_from_civil(t->year, t->month, t->day) * 86400 + t->hour * 3600 + t->minute * 60 + t->second;
+
+	if (t->second_part)
+		lua_pushnumber(L, (lua_Number)seconds + (lua_Number)t->second_part / 1000000);
+	else
+		push_longlong(L, seconds);
+}
+
+/*
+ * TIME as a (possibly negative) number of seconds
+ */
+static void decode_seconds(lua_State *L, MYSQL_BIND *bind) {
+	MYSQL_TIME *t = bind->buffer;
+	long long seconds = (long long)t->hour * 3600 + t->minute * 60 + t->second;
 
+	if (t->second_part) {
+		lua_Number v = (lua_Number)seconds + (lua_Number)t->second_part / 1000000;
+
+		lua_pushnumber(L, t->neg ? -v : v);
+	} else {
+		push_longlong(L, t->neg ? -seconds : seconds);
+	}
+}
+
+static decoder_t mysql_decoder(MYSQL_FIELD *field, int epoch, int numeric) {
+	int is_unsigned = field->flags & UNSIGNED_FLAG;
+
+	switch (field->type) {
+	case MYSQL_TYPE_NULL:
+		return decode_nil;
 	case MYSQL_TYPE_TINY:
-	case MYSQL_TYPE_YEAR:
+		return is_unsigned ? decode_uint8 : decode_int8;
 	case MYSQL_TYPE_SHORT:
+		return is_unsigned ? decode_uint16 : decode_int16;
+	case MYSQL_TYPE_YEAR:
+		return decode_uint16;
 	case MYSQL_TYPE_INT24:
 	case MYSQL_TYPE_LONG:
-		lua_type =  LUA_PUSH_INTEGER;
-		break;
-
+		return is_unsigned ? decode_uint32 : decode_int32;
+	case MYSQL_TYPE_LONGLONG:
+		return is_unsigned ? decode_uint64 : decode_int64;
 	case MYSQL_TYPE_FLOAT:
+		return decode_float;
 	case MYSQL_TYPE_DOUBLE:
-	case MYSQL_TYPE_LONGLONG:
-		lua_type = LUA_PUSH_NUMBER;
-		break;
-
+		return decode_double;
+	case MYSQL_TYPE_DECIMAL:
+	case MYSQL_TYPE_NEWDECIMAL:
+		return numeric ? decode_decimal : decode_string;
+	case MYSQL_TYPE_DATETIME:
+	case MYSQL_TYPE_TIMESTAMP:
+		return epoch ? decode_epoch : decode_datetime;
+	case MYSQL_TYPE_DATE:
+		return epoch ? decode_epoch : decode_date;
+	case MYSQL_TYPE_TIME:
+		return epoch ? decode_seconds : decode_time;
 	default:
-		lua_type = LUA_PUSH_STRING;
+		return decode_string;
 	}
-
-	return lua_type;
 }
 
 static size_t mysql_buffer_size(MYSQL_FIELD *field) {
@@ -69,6 +258,178 @@ static size_t mysql_buffer_size(MYSQL_FIELD *field) {
 	return size;
 }
 
+/*
+ * frees the result buffers bound by bind_results()
+ */
+static void free_results(statement_t *statement) {
+	int i;
+
+	if (statement->bind) {
+		for (i = 0; i < statement->num_columns; i++) {
+			free(statement->bind[i].buffer);
+		}
+
+		free(statement->bind);
+		statement->bind = NULL;
+	}
+
+	if (statement->is_null) {
+		free(statement->is_null);
+		statement->is_null = NULL;
+	}
+
+	if (statement->lengths) {
+		free(statement->lengths);
+		statement->lengths = NULL;
+	}
+
+	if (statement->decoders) {
+		free(statement->decoders);
+		statement->decoders = NULL;
+	}
+
+	statement->num_columns = 0;
+	statement->fields = NULL;
+}
+
+/*
+ * drops the metadata and result buffers, so that the next result is
+ * described from scratch
+ */
+static void forget_results(statement_t *statement) {
+	if (statement->metadata) {
+		mysql_free_result(statement->metadata);
+		statement->metadata = NULL;
+	}
+
+	free_results(statement);
+	statement->cached = 0;
+}
+
+/*
+ * true if the result of the latest execute has the columns that the
+ * buffers were bound for by an earlier execute. The server flags any
+ * change to the types, eg. after an ALTER TABLE.
+ */
+static int same_result(statement_t *statement) {
+	return statement->cached &&
+	       !(statement->conn->mysql->server_status & SERVER_STATUS_METADATA_CHANGED) &&
+	       mysql_stmt_field_count(statement->stmt) == (unsigned int)statement->num_columns;
+}
+
+/*
+ * allocates a buffer for every column of the result set and binds
+ * them to the statement, so that fetching a row needs no further
+ * allocation. Returns 0 on success.
+ */
+static int bind_results(statement_t *statement) {
+	int column_count = mysql_num_fields(statement->metadata);
+	MYSQL_FIELD *fields = mysql_fetch_fields(statement->metadata);
+	int i;
+
+	free_results(statement);
+
+	if (column_count == 0)
+		return 0;
+
+	statement->bind = calloc(column_count, sizeof(MYSQL_BIND));
+	statement->is_null = calloc(column_count, sizeof(my_bool));
+	statement->lengths = calloc(column_count, sizeof(unsigned long));
+	statement->decoders = calloc(column_count, sizeof(decoder_t));
+
+	if (!statement->bind || !statement->is_null || !statement->lengths || !statement->decoders) {
+		free_results(statement);
+		return 1;
+	}
+
+	statement->num_columns = column_count;
+	statement->fields = fields;
+
+	for (i = 0; i < column_count; i++) {
+		size_t length = mysql_buffer_size(&fields[i]);
+
+		/*
+		 * deferred columns are fetched as strings into an empty
+		 * buffer, which only reports their length
+		 */
+		if (i < statement->num_deferred && statement->deferred[i]) {
+			statement->bind[i].buffer = calloc(1, 1);
+			if (!statement->bind[i].buffer) {
+				free_results(statement);
+				return 1;
+			}
+
+			statement->bind[i].buffer_type = MYSQL_TYPE_STRING;
+			statement->bind[i].length = &statement->lengths[i];
+			statement->bind[i].is_null = &statement->is_null[i];
+			continue;
+		}
+
+		if (length > DBD_MYSQL_PREALLOC_SIZE)
+			length = DBD_MYSQL_PREALLOC_SIZE;
+
+		if (length == 0)
+			length = 1;
+
+		statement->bind[i].buffer = calloc(length, 1);
+		if (!statement->bind[i].buffer) {
+			free_results(statement);
+			return 1;
+		}
+
+		statement->bind[i].buffer_length = length;
+		statement->bind[i].buffer_type = fields[i].type;
+		statement->bind[i].is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+		statement->bind[i].length = &statement->lengths[i];
+		statement->bind[i].is_null = &statement->is_null[i];
+
+		statement->decoders[i] = mysql_decoder(&fields[i], statement->epoch, statement->numeric);
+	}
+
+	return mysql_stmt_bind_result(statement->stmt, statement->bind);
+}
+
+/*
+ * describes the result of the latest execute and binds buffers for
+ * it, unless those of an earlier execute still fit. Statements that
+ * return no result set are left without metadata. Returns 0 on
+ * success.
+ */
+static int describe_result(statement_t *statement) {
+	if (same_result(statement))
+		return 0;
+
+	forget_results(statement);
+
+	statement->metadata = mysql_stmt_result_metadata(statement->stmt);
+	if (!statement->metadata)
+		return 0;
+
+	if (bind_results(statement))
+		return 1;
+
+	statement->cached = 1;
+	return 0;
+}
+
+/*
+ * reads a column that did not fit its buffer again, after growing
+ * the buffer to the full length of the value. Returns 0 on success.
+ */
+static int fetch_truncated(statement_t *statement, int i) {
+	MYSQL_BIND *bind = &statement->bind[i];
+	unsigned long length = statement->lengths[i];
+	void *buffer = realloc(bind->buffer, length);
+
+	if (!buffer)
+		return 1;
+
+	bind->buffer = buffer;
+	bind->buffer_length = length;
+
+	return mysql_stmt_fetch_column(statement->stmt, bind, i, 0);
+}
+
 /*
  * num_affected_rows = statement:affected()
  */
@@ -95,9 +456,23 @@ static int statement_close(lua_State *L) {
 		statement->metadata = NULL;
 	}
 
-	if (statement->lengths) {
-		free(statement->lengths);
-		statement->lengths = NULL;
+	free_results(statement);
+
+	if (statement->deferred) {
+		free(statement->deferred);
+		statement->deferred = NULL;
+		statement->num_deferred = 0;
+	}
+
+	if (statement->batch) {
+		mysql_stmt_close(statement->batch);
+		statement->batch = NULL;
+		statement->batch_rows = 0;
+	}
+
+	if (statement->insert) {
+		free(statement->insert);
+		statement->insert = NULL;
 	}
 
 	if (statement->stmt) {
@@ -139,22 +514,117 @@ static int statement_columns(lua_State *L) {
 
 
 /*
- * success,err = statement:execute(...)
+ * sends the DBI.stream() parameter at index p in chunks as it is
+ * read. Returns 0 on success, otherwise err holds the reader's error
+ * or is empty for an error from the client library.
  */
-static int statement_execute(lua_State *L) {
+static int send_stream(lua_State *L, statement_t *statement, int p, char *err, size_t errlen) {
+	int sent = 0;
+
+	err[0] = '\0';
+
+	for (;;) {
+		const char *data;
+		size_t len;
+
+		if (dbd_stream_read(L, p)) {
+			snprintf(err, errlen, "%s", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return 1;
+		}
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+
+		data = lua_tolstring(L, -1, &len);
+
+		if (len > 0 && mysql_stmt_send_long_data(statement->stmt, p - 2, data, len)) {
+			lua_pop(L, 1);
+			return 1;
+		}
+
+		sent |= len > 0;
+		lua_pop(L, 1);
+	}
+
+	/*
+	 * without any long data the value would be NULL
+	 */
+	if (!sent && mysql_stmt_send_long_data(statement->stmt, p - 2, "", 0))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * executes the statement with the parameters from index 2 on. With
+ * async the execution is only started, for statement:poll().
+ */
+/*
+ * binds the nil, boolean, number or string at index, keeping the
+ * converted value in value. Returns 1 for any other type.
+ */
+static int bind_param(lua_State *L, int index, MYSQL_BIND *bind, param_value_t *value) {
+	size_t len;
+
+	switch(lua_type(L, index)) {
+	case LUA_TNIL:
+		bind->buffer_type = MYSQL_TYPE_NULL;
+		break;
+
+	case LUA_TBOOLEAN:
+		value->boolean = lua_toboolean(L, index);
+
+		bind->buffer_type = MYSQL_TYPE_LONG;
+		bind->buffer = &value->boolean;
+		break;
+
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM > 502
+		if (lua_isinteger(L, index)) {
+			value->integer = lua_tointeger(L, index);
+
+			bind->buffer_type = MYSQL_TYPE_LONGLONG;
+			bind->buffer = &value->integer;
+			break;
+		}
+#endif
+		value->number = lua_tonumber(L, index);
+
+		bind->buffer_type = MYSQL_TYPE_DOUBLE;
+		bind->buffer = &value->number;
+		break;
+
+	case LUA_TSTRING:
+		bind->buffer_type = MYSQL_TYPE_STRING;
+		bind->buffer = (char *)lua_tolstring(L, index, &len);
+		value->length = len;
+		bind->buffer_length = len;
+		bind->length = &value->length;
+		break;
+
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+static int execute(lua_State *L, int async) {
 	int n = lua_gettop(L);
 	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
 	int num_bind_params = n - 1;
 	int expected_params;
 
-	unsigned char *buffer = NULL;
-	int offset = 0;
+	param_value_t *values = NULL;
 
 	MYSQL_BIND *bind = NULL;
-	MYSQL_RES *metadata = NULL;
 
 	char *error_message = NULL;
 	char *errstr = NULL;
+	char err[256];
 
 	int p;
 
@@ -169,13 +639,11 @@ static int statement_execute(lua_State *L) {
 	}
 
 
-	if (statement->metadata) {
-		/*
-		 * free existing metadata from any previous executions
-		 */
-		mysql_free_result(statement->metadata);
-		statement->metadata = NULL;
-	}
+	/*
+	 * the metadata of previous executions is kept, and reused if
+	 * the result has the same columns
+	 */
+	statement->has_result = 0;
 
 	if (!statement->stmt) {
 		lua_pushboolean(L, 0);
@@ -183,6 +651,12 @@ static int statement_execute(lua_State *L) {
 		return 2;
 	}
 
+	if (statement->async) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_ASYNC_PENDING);
+		return 2;
+	}
+
 	expected_params = mysql_stmt_param_count(statement->stmt);
 
 	if (expected_params != num_bind_params) {
@@ -196,82 +670,27 @@ static int statement_execute(lua_State *L) {
 	}
 
 	if (num_bind_params > 0) {
-		bind = malloc(sizeof(MYSQL_BIND) * num_bind_params);
-		if (bind == NULL) {
+		bind = calloc(num_bind_params, sizeof(MYSQL_BIND));
+		values = calloc(num_bind_params, sizeof(param_value_t));
+
+		if (bind == NULL || values == NULL) {
+			free(bind);
+			free(values);
 			luaL_error(L, "Could not alloc bind params\n");
 		}
-
-		buffer = (unsigned char *)malloc(num_bind_params * sizeof(double));
-		memset(bind, 0, sizeof(MYSQL_BIND) * num_bind_params);
 	}
 
 	for (p = 2; p <= n; p++) {
 		int type = lua_type(L, p);
 		int i = p - 2;
 
-		const char *str = NULL;
-		size_t *str_len = NULL;
-		double *num = NULL;
-		long *inum = NULL;
-		int *boolean = NULL;
-		char err[64];
-
-		switch(type) {
-		case LUA_TNIL:
-			bind[i].buffer_type = MYSQL_TYPE_NULL;
-			break;
-
-		case LUA_TBOOLEAN:
-			boolean = (int *)(buffer + offset);
-			offset += sizeof(int);
-			*boolean = lua_toboolean(L, p);
-
-			bind[i].buffer_type = MYSQL_TYPE_LONG;
-			bind[i].is_null = (my_bool*)0;
-			bind[i].buffer = (char *)boolean;
-			bind[i].length = 0;
-			break;
-
-		case LUA_TNUMBER:
-#if LUA_VERSION_NUM > 502
-			if (lua_isinteger(L, p)) {
-				inum = (long *)(buffer + offset);
-				offset += sizeof(long);
-				*inum = lua_tointeger(L, p);
-
-				bind[i].buffer_type = MYSQL_TYPE_LONG;
-				bind[i].is_null = (my_bool*)0;
-				bind[i].buffer = (char *)inum;
-				bind[i].length = 0;
-				break;
-			}
-#endif
+		if (type == LUA_TTABLE && dbd_is_stream(L, p)) {
 			/*
-			 * num needs to be it's own
-			 * memory here
+			 * streams are sent with mysql_stmt_send_long_data()
+			 * once the parameters are bound
 			 */
-			num = (double *)(buffer + offset);
-			offset += sizeof(double);
-			*num = lua_tonumber(L, p);
-			
-			bind[i].buffer_type = MYSQL_TYPE_DOUBLE;
-			bind[i].is_null = (my_bool*)0;
-			bind[i].buffer = (char *)num;
-			bind[i].length = 0;
-			break;
-
-		case LUA_TSTRING:
-			str_len = (size_t *)(buffer + offset);
-			offset += sizeof(size_t);
-			str = lua_tolstring(L, p, str_len);
-
-			bind[i].buffer_type = MYSQL_TYPE_STRING;
-			bind[i].is_null = (my_bool*)0;
-			bind[i].buffer = (char *)str;
-			bind[i].length = (unsigned long *)str_len;
-			break;
-
-		default:
+			bind[i].buffer_type = MYSQL_TYPE_LONG_BLOB;
+		} else if (bind_param(L, p, &bind[i], &values[i])) {
 			snprintf(err, sizeof(err)-1, DBI_ERR_BINDING_TYPE_ERR, lua_typename(L, type));
 			errstr = err;
 			error_message = DBI_ERR_BINDING_PARAMS;
@@ -284,24 +703,52 @@ static int statement_execute(lua_State *L) {
 		goto cleanup;
 	}
 
+	for (p = 2; p <= n; p++) {
+		if (bind[p - 2].buffer_type == MYSQL_TYPE_LONG_BLOB && send_stream(L, statement, p, err, sizeof(err))) {
+			errstr = err[0] ? err : NULL;
+			error_message = DBI_ERR_BINDING_PARAMS;
+			goto cleanup;
+		}
+	}
+
+#ifdef MYSQL_WAIT_READ
+	if (async) {
+		statement->wait = mysql_stmt_execute_start(&statement->result, statement->stmt);
+
+		if (!statement->wait && statement->result) {
+			error_message = DBI_ERR_BINDING_EXEC;
+			goto cleanup;
+		}
+
+		statement->async = DBD_MYSQL_ASYNC_EXECUTE;
+		goto cleanup;
+	}
+#endif
+
 	if (mysql_stmt_execute(statement->stmt)) {
 		error_message = DBI_ERR_BINDING_EXEC;
 		goto cleanup;
 	}
 
-	metadata = mysql_stmt_result_metadata(statement->stmt);
+	if (describe_result(statement)) {
+		error_message = DBI_ERR_BINDING_RESULTS;
+		goto cleanup;
+	}
 
-	if (metadata) {
-		mysql_stmt_store_result(statement->stmt);
+	if (statement->metadata && !statement->stream && mysql_stmt_store_result(statement->stmt)) {
+		error_message = DBI_ERR_BINDING_EXEC;
+		goto cleanup;
 	}
 
+	statement->has_result = 1;
+
 cleanup:
 	if (bind) {
 		free(bind);
 	}
 
-	if (buffer) {
-		free(buffer);
+	if (values) {
+		free(values);
 	}
 
 	if (error_message) {
@@ -310,210 +757,683 @@ cleanup:
 		return 2;
 	}
 
-	statement->metadata = metadata;
-
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int statement_fetch_impl(lua_State *L, statement_t *statement, int named_columns) {
-	int column_count, fetch_result_ok;
-	MYSQL_BIND *bind = NULL;
-	my_bool *is_null = NULL;
-	const char *error_message = NULL;
+/*
+ * success,err = statement:execute(...)
+ */
+static int statement_execute(lua_State *L) {
+	return execute(L, 0);
+}
 
-	if (!statement->stmt) {
-		luaL_error(L, DBI_ERR_FETCH_INVALID);
+#if defined(MARIADB_PACKAGE_VERSION_ID) && MARIADB_PACKAGE_VERSION_ID >= 30000
+/*
+ * whether the server accepts array binding. MySQL servers and
+ * MariaDB before 10.2 reject it.
+ */
+static int bulk_supported(statement_t *statement) {
+	unsigned long caps = 0;
+
+	if (mariadb_get_infov(statement->conn->mysql, MARIADB_CONNECTION_EXTENDED_SERVER_CAPABILITIES, &caps))
 		return 0;
+
+	return (caps & (MARIADB_CLIENT_STMT_BULK_OPERATIONS >> 32)) != 0;
+}
+
+/*
+ * executes every row of the table at index 2 in a single round trip
+ * using MariaDB's column-wise array binding. Returns the number of
+ * results pushed, or -1 without pushing anything if the rows can't
+ * be bound that way, eg. because a column mixes strings and numbers
+ * or the server does not support it.
+ */
+static int execute_bulk(lua_State *L, statement_t *statement, int num_rows, int num_params) {
+	MYSQL_BIND *bind = calloc(num_params, sizeof(MYSQL_BIND));
+	char *data = calloc((size_t)num_rows * num_params, 8);
+	char *indicators = calloc((size_t)num_rows * num_params, 1);
+	unsigned long *lengths = calloc((size_t)num_rows * num_params, sizeof(unsigned long));
+	unsigned int array_size = num_rows;
+	int ret = -1;
+	int c, r;
+
+	if (!bind || !data || !indicators || !lengths || !bulk_supported(statement))
+		goto cleanup;
+
+	for (c = 0; c < num_params; c++) {
+		char *column = data + (size_t)c * num_rows * 8;
+		char *indicator = indicators + (size_t)c * num_rows;
+		unsigned long *length = lengths + (size_t)c * num_rows;
+		int type = LUA_TNIL;
+		int integer = 1;
+		size_t len;
+
+		/*
+		 * every value in a column has to share a type
+		 */
+		for (r = 0; r < num_rows; r++) {
+			int t;
+
+			lua_rawgeti(L, 2, r + 1);
+			lua_rawgeti(L, -1, c + 1);
+			t = lua_type(L, -1);
+
+#if LUA_VERSION_NUM > 502
+			if (t == LUA_TNUMBER && !lua_isinteger(L, -1))
+				integer = 0;
+#else
+			integer = 0;
+#endif
+			lua_pop(L, 2);
+
+			if (t == LUA_TNIL)
+				continue;
+
+			if ((type != LUA_TNIL && t != type) ||
+			    (t != LUA_TBOOLEAN && t != LUA_TNUMBER && t != LUA_TSTRING))
+				goto cleanup;
+
+			type = t;
+		}
+
+		for (r = 0; r < num_rows; r++) {
+			lua_rawgeti(L, 2, r + 1);
+			lua_rawgeti(L, -1, c + 1);
+
+			if (lua_isnil(L, -1)) {
+				indicator[r] = STMT_INDICATOR_NULL;
+			} else {
+				indicator[r] = STMT_INDICATOR_NONE;
+
+				switch (type) {
+				case LUA_TBOOLEAN:
+					((int *)column)[r] = lua_toboolean(L, -1);
+					break;
+				case LUA_TNUMBER:
+					if (integer)
+						((long long *)column)[r] = lua_tointeger(L, -1);
+					else
+						((double *)column)[r] = lua_tonumber(L, -1);
+					break;
+				case LUA_TSTRING:
+					/*
+					 * the strings stay referenced by the row
+					 * tables, so the pointers outlive the pop
+					 */
+					((const char **)column)[r] = lua_tolstring(L, -1, &len);
+					length[r] = len;
+					break;
+				}
+			}
+
+			lua_pop(L, 2);
+		}
+
+		bind[c].u.indicator = indicator;
+		bind[c].buffer = column;
+
+		switch (type) {
+		case LUA_TNIL:
+			bind[c].buffer_type = MYSQL_TYPE_NULL;
+			break;
+		case LUA_TBOOLEAN:
+			bind[c].buffer_type = MYSQL_TYPE_LONG;
+			break;
+		case LUA_TNUMBER:
+			bind[c].buffer_type = integer ? MYSQL_TYPE_LONGLONG : MYSQL_TYPE_DOUBLE;
+			break;
+		case LUA_TSTRING:
+			bind[c].buffer_type = MYSQL_TYPE_STRING;
+			bind[c].length = length;
+			break;
+		}
 	}
 
-	if (!statement->metadata) {
-		luaL_error(L, DBI_ERR_FETCH_NO_EXECUTE);
+	if (mysql_stmt_attr_set(statement->stmt, STMT_ATTR_ARRAY_SIZE, &array_size)) {
+		/*
+		 * not available, so fall back to executing row by row
+		 */
+		goto cleanup;
+	} else if (mysql_stmt_bind_param(statement->stmt, bind)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_BINDING_PARAMS, mysql_stmt_error(statement->stmt));
+		ret = 2;
+	} else if (mysql_stmt_execute(statement->stmt)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_BINDING_EXEC, mysql_stmt_error(statement->stmt));
+		ret = 2;
+	} else {
+		lua_pushinteger(L, mysql_stmt_affected_rows(statement->stmt));
+		ret = 1;
+	}
+
+	array_size = 0;
+	mysql_stmt_attr_set(statement->stmt, STMT_ATTR_ARRAY_SIZE, &array_size);
+
+cleanup:
+	free(bind);
+	free(data);
+	free(indicators);
+	free(lengths);
+
+	return ret;
+}
+#endif
+
+/*
+ * returns the offset past the quoted string, quoted identifier or
+ * comment starting at sql[i], or i if there is none there
+ */
+static size_t skip_quoted(const char *sql, size_t i) {
+	char c = sql[i];
+	const char *end;
+
+	if (c == '\'' || c == '"' || c == '`') {
+		for (i++; sql[i] && sql[i] != c; i++) {
+			if (sql[i] == '\\' && c != '`' && sql[i + 1])
+				i++;
+		}
+
+		return sql[i] ? i + 1 : i;
+	}
+
+	if (c == '#' || (c == '-' && sql[i + 1] == '-' && isspace((unsigned char)sql[i + 2]))) {
+		end = strchr(sql + i, '\n');
+		return end ? (size_t)(end - sql) + 1 : strlen(sql);
+	}
+
+	if (c == '/' && sql[i + 1] == '*') {
+		end = strstr(sql + i + 2, "*/");
+		return end ? (size_t)(end - sql) + 2 : strlen(sql);
+	}
+
+	return i;
+}
+
+static int is_word(const char *sql, size_t len, const char *word) {
+	size_t i;
+
+	if (strlen(word) != len)
 		return 0;
+
+	for (i = 0; i < len; i++) {
+		if (tolower((unsigned char)sql[i]) != word[i])
+			return 0;
 	}
 
-	column_count = mysql_num_fields(statement->metadata);
+	return 1;
+}
 
-	if (column_count > 0) {
-		int i;
-		MYSQL_FIELD *fields;
+/*
+ * finds the row of values of an INSERT or REPLACE, which has to hold
+ * every placeholder of the statement. Returns 0 for anything else,
+ * including inserts that already list several rows.
+ */
+static int find_values(const char *sql, int num_params, size_t *start, size_t *len) {
+	size_t i, next, word;
+	int depth = 0;
+	int params = 0;         /* outside the row */
+	int row_params = 0;
+
+	for (i = 0; isspace((unsigned char)sql[i]); i++)
+		;
+
+	for (word = i; isalpha((unsigned char)sql[i]); i++)
+		;
+
+	if (!is_word(sql + word, i - word, "insert") && !is_word(sql + word, i - word, "replace"))
+		return 0;
+
+	for (; sql[i]; i = next) {
+		next = skip_quoted(sql, i);
+		if (next > i)
+			continue;
+
+		next = i + 1;
+
+		if (isalpha((unsigned char)sql[i]) || sql[i] == '_') {
+			while (isalnum((unsigned char)sql[next]) || sql[next] == '_' || sql[next] == '$')
+				next++;
 
-		if (statement->lengths) {
-			free(statement->lengths);
-			statement->lengths = NULL;
+			if (row_params || depth > 0 || !(is_word(sql + i, next - i, "values") || is_word(sql + i, next - i, "value")))
+				continue;
+
+			while (isspace((unsigned char)sql[next]))
+				next++;
+
+			if (sql[next] != '(')
+				return 0;
+
+			*start = next;
+
+			for (depth = 0; sql[next]; ) {
+				i = skip_quoted(sql, next);
+				if (i > next) {
+					next = i;
+					continue;
+				}
+
+				if (sql[next] == '(')
+					depth++;
+				else if (sql[next] == ')' && --depth == 0)
+					break;
+				else if (sql[next] == '?')
+					row_params++;
+
+				next++;
+			}
+
+			if (!sql[next] || row_params != num_params)
+				return 0;
+
+			*len = ++next - *start;
+
+			for (i = next; isspace((unsigned char)sql[i]); i++)
+				;
+
+			if (sql[i] == ',')
+				return 0;
+		} else if (sql[i] == '(') {
+			depth++;
+		} else if (sql[i] == ')') {
+			depth--;
+		} else if (sql[i] == '?') {
+			params++;
 		}
+	}
+
+	return row_params > 0 && params == 0;
+}
 
-		statement->lengths = calloc(column_count, sizeof(unsigned long));
+/*
+ * prepares the insert with its row of values repeated rows times
+ */
+static MYSQL_STMT *prepare_batch(statement_t *statement, int rows) {
+	const char *row = statement->insert + statement->values_start;
+	size_t end = statement->values_start + statement->values_len;
+	size_t sql_len = strlen(statement->insert) + (size_t)(rows - 1) * (statement->values_len + 1);
+	char *sql = malloc(sql_len + 1);
+	MYSQL_STMT *stmt = NULL;
+	char *p;
+	int r;
+
+	if (!sql)
+		return NULL;
+
+	memcpy(sql, statement->insert, end);
+	p = sql + end;
+
+	for (r = 1; r < rows; r++) {
+		*p++ = ',';
+		memcpy(p, row, statement->values_len);
+		p += statement->values_len;
+	}
 
-		bind = malloc(sizeof(MYSQL_BIND) * column_count);
-		memset(bind, 0, sizeof(MYSQL_BIND) * column_count);
-		is_null = malloc(sizeof(my_bool) * column_count);
-		memset(is_null, 0, sizeof(my_bool) * column_count);
+	strcpy(p, statement->insert + end);
 
-		fields = mysql_fetch_fields(statement->metadata);
+	stmt = mysql_stmt_init(statement->conn->mysql);
 
-		for (i = 0; i < column_count; i++) {
-			unsigned int length = mysql_buffer_size(&fields[i]);
-			if (length > sizeof(MYSQL_TIME)) {
-				bind[i].buffer = NULL;
-				bind[i].buffer_length = 0;
-			} else {
-				char *buffer = (char *)malloc(length);
-				memset(buffer, 0, length);
+	if (stmt && mysql_stmt_prepare(stmt, sql, sql_len)) {
+		mysql_stmt_close(stmt);
+		stmt = NULL;
+	}
+
+	free(sql);
+
+	return stmt;
+}
+
+/*
+ * executes the rows of the table at index 2 as multi-row inserts of
+ * up to DBD_MYSQL_BATCH_ROWS rows, adding to affected. The statement
+ * for a full batch is kept for the next call. Returns how many rows
+ * were executed, leaving the rest to be executed one by one, or -1
+ * after pushing nil and an error.
+ */
+static int execute_batches(lua_State *L, statement_t *statement, int num_rows, int num_params, my_ulonglong *affected) {
+	int rows = DBD_MYSQL_BATCH_ROWS;
+	MYSQL_BIND *bind = NULL;
+	param_value_t *values = NULL;
+	int done = 0;
+
+	if (rows > DBD_MYSQL_MAX_PARAMS / num_params)
+		rows = DBD_MYSQL_MAX_PARAMS / num_params;
 
-				bind[i].buffer = buffer;
-				bind[i].buffer_length = length;
+	if (rows > num_rows)
+		rows = num_rows;
+
+	if (rows < 2)
+		return 0;
+
+	bind = calloc((size_t)rows * num_params, sizeof(MYSQL_BIND));
+	values = calloc((size_t)rows * num_params, sizeof(param_value_t));
+
+	if (!bind || !values)
+		goto cleanup;
+
+	while (num_rows - done > 1) {
+		int n = num_rows - done < rows ? num_rows - done : rows;
+		MYSQL_STMT *stmt;
+		int unbound = 0;
+		int r, c;
+
+		memset(bind, 0, (size_t)n * num_params * sizeof(MYSQL_BIND));
+
+		for (r = 0; r < n && !unbound; r++) {
+			lua_rawgeti(L, 2, done + r + 1);
+
+			for (c = 0; c < num_params && !unbound; c++) {
+				int i = r * num_params + c;
+
+				/*
+				 * the strings stay referenced by the row tables,
+				 * so the pointers outlive the pop
+				 */
+				lua_rawgeti(L, -1, c + 1);
+				unbound = bind_param(L, -1, &bind[i], &values[i]);
+				lua_pop(L, 1);
 			}
 
-			bind[i].buffer_type = fields[i].type;
-			bind[i].length = &(statement->lengths[i]);
-			bind[i].is_null = &is_null[i];
+			lua_pop(L, 1);
 		}
 
-		if (mysql_stmt_bind_result(statement->stmt, bind)) {
-			error_message = DBI_ERR_BINDING_RESULTS;
-			goto cleanup;
+		/*
+		 * streams are left to execute()
+		 */
+		if (unbound)
+			break;
+
+		if (n == rows) {
+			if (statement->batch && statement->batch_rows != n) {
+				mysql_stmt_close(statement->batch);
+				statement->batch = NULL;
+			}
+
+			if (!statement->batch) {
+				statement->batch = prepare_batch(statement, n);
+				statement->batch_rows = n;
+			}
+
+			stmt = statement->batch;
+		} else {
+			stmt = prepare_batch(statement, n);
 		}
 
-		fetch_result_ok = mysql_stmt_fetch(statement->stmt);
-		if (fetch_result_ok == 0 || fetch_result_ok == MYSQL_DATA_TRUNCATED) {
-			int d = 1;
+		if (!stmt)
+			break;
 
-			lua_newtable(L);
-			for (i = 0; i < column_count; i++) {
-				lua_push_type_t lua_push = mysql_to_lua_push(fields[i].type);
-				const char *name = fields[i].name;
-
-				if (bind[i].buffer == NULL) {
-					char *buffer = (char *)calloc(statement->lengths[i]+1, sizeof(char));
-					bind[i].buffer = buffer;
-					bind[i].buffer_length = statement->lengths[i];
-					mysql_stmt_fetch_column(statement->stmt, &bind[i], i, 0);
-				}
+		if (mysql_stmt_bind_param(stmt, bind) || mysql_stmt_execute(stmt)) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "rows %d to %d: " DBI_ERR_BINDING_EXEC, done + 1, done + n, mysql_stmt_error(stmt));
+			done = -1;
+		} else {
+			*affected += mysql_stmt_affected_rows(stmt);
+			done += n;
+		}
 
-				if (lua_push == LUA_PUSH_NIL || *(bind[i].is_null)) {
-					if (named_columns) {
-						LUA_PUSH_ATTRIB_NIL(name);
-					} else {
-						LUA_PUSH_ARRAY_NIL(d);
-					}
-				} else if (lua_push == LUA_PUSH_INTEGER) {
-					if (fields[i].type == MYSQL_TYPE_YEAR || fields[i].type == MYSQL_TYPE_SHORT) {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_INT(name, *(short *)(bind[i].buffer));
-						} else {
-							LUA_PUSH_ARRAY_INT(d, *(short *)(bind[i].buffer));
-						}
-					} else if (fields[i].type == MYSQL_TYPE_TINY) {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_INT(name, (int)*(char *)(bind[i].buffer));
-						} else {
-							LUA_PUSH_ARRAY_INT(d, (int)*(char *)(bind[i].buffer));
-						}
-					} else {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_INT(name, *(int *)(bind[i].buffer));
-						} else {
-							LUA_PUSH_ARRAY_INT(d, *(int *)(bind[i].buffer));
-						}
-					}
-				} else if (lua_push == LUA_PUSH_NUMBER) {
-					if (fields[i].type == MYSQL_TYPE_FLOAT) {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_FLOAT(name, *(float *)(bind[i].buffer));
-						} else {
-							LUA_PUSH_ARRAY_FLOAT(d, *(float *)(bind[i].buffer));
-						}
-					} else if (fields[i].type == MYSQL_TYPE_DOUBLE) {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_FLOAT(name, *(double *)(bind[i].buffer));
-						} else {
-							LUA_PUSH_ARRAY_FLOAT(d, *(double *)(bind[i].buffer));
-						}
-					} else {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_FLOAT(name, *(long long *)(bind[i].buffer));
-						} else {
-							LUA_PUSH_ARRAY_FLOAT(d, *(long long *)(bind[i].buffer));
-						}
-					}
-				} else if (lua_push == LUA_PUSH_STRING) {
+		if (stmt != statement->batch)
+			mysql_stmt_close(stmt);
 
-					if (fields[i].type == MYSQL_TYPE_TIMESTAMP || fields[i].type == MYSQL_TYPE_DATETIME) {
-						char str[20];
-						MYSQL_TIME *t = bind[i].buffer;
+		if (done < 0)
+			break;
+	}
 
-						snprintf(str, 20, "%d-%02d-%02d %02d:%02d:%02d", t->year, t->month, t->day, t->hour, t->minute, t->second);
+cleanup:
+	free(bind);
+	free(values);
 
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_STRING(name, str);
-						} else {
-							LUA_PUSH_ARRAY_STRING(d, str);
-						}
-					} else if (fields[i].type == MYSQL_TYPE_TIME) {
-						char str[9];
-						MYSQL_TIME *t = bind[i].buffer;
+	return done;
+}
+
+/*
+ * affected,err = statement:executemany(rows)
+ *
+ * Executes the statement once for each array of parameters in rows,
+ * which must each hold a value for every parameter, returning the
+ * total number of affected rows. With MariaDB's
+ * Connector/C all rows are sent in one round trip, as long as each
+ * parameter has the same type in every row. Otherwise the rows of an
+ * INSERT ... VALUES (...) are sent as multi-row inserts, and those of
+ * any other statement are executed one by one.
+ */
+static int statement_executemany(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
+	int num_rows;
+	int num_params;
+	my_ulonglong affected = 0;
+	int first = 1;
+	int r, c;
 
-						snprintf(str, 9, "%02d:%02d:%02d", t->hour, t->minute, t->second);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
 
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_STRING(name, str);
-						} else {
-							LUA_PUSH_ARRAY_STRING(d, str);
-						}
-					} else if (fields[i].type == MYSQL_TYPE_DATE) {
-						char str[20];
-						MYSQL_TIME *t = bind[i].buffer;
+	if (statement->conn->mysql == NULL) {
+		lua_pushstring(L, DBI_ERR_STATEMENT_BROKEN);
+		lua_error(L);
+	}
 
-						snprintf(str, 11, "%d-%02d-%02d", t->year, t->month, t->day);
+	if (!statement->stmt) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_EXECUTE_INVALID);
+		return 2;
+	}
 
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_STRING(name, str);
-						} else {
-							LUA_PUSH_ARRAY_STRING(d, str);
-						}
+	num_rows = dbd_rawlen(L, 2);
+	num_params = mysql_stmt_param_count(statement->stmt);
+
+	for (r = 1; r <= num_rows; r++) {
+		lua_rawgeti(L, 2, r);
+		if (!lua_istable(L, -1)) {
+			luaL_argerror(L, 2, lua_pushfstring(L, "row %d is not a table", r));
+		}
+		if ((int)dbd_rawlen(L, -1) != num_params) {
+			luaL_argerror(L, 2, lua_pushfstring(L, "row %d has %d values, expected %d", r, (int)dbd_rawlen(L, -1), num_params));
+		}
+		lua_pop(L, 1);
+	}
+
+	forget_results(statement);
+	statement->has_result = 0;
+
+#if defined(MARIADB_PACKAGE_VERSION_ID) && MARIADB_PACKAGE_VERSION_ID >= 30000
+	if (num_rows > 1 && num_params > 0 && mysql_stmt_field_count(statement->stmt) == 0) {
+		int ret = execute_bulk(L, statement, num_rows, num_params);
+
+		if (ret >= 0)
+			return ret;
+	}
+#endif
+
+	if (statement->insert && num_rows > 1) {
+		int done = execute_batches(L, statement, num_rows, num_params, &affected);
+
+		if (done < 0)
+			return 2;
+
+		first = done + 1;
+	}
+
+	/*
+	 * one execute per row
+	 */
+	for (r = first; r <= num_rows; r++) {
+		lua_pushcfunction(L, statement_execute);
+		lua_pushvalue(L, 1);
+
+		lua_rawgeti(L, 2, r);
+		for (c = 1; c <= num_params; c++) {
+			lua_rawgeti(L, -c, c);
+		}
+		lua_remove(L, -num_params - 1);
+
+		lua_call(L, num_params + 1, 2);
+
+		if (!lua_toboolean(L, -2)) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "row %d: %s", r, lua_tostring(L, -2));
+			return 2;
+		}
+
+		lua_pop(L, 2);
+		affected += mysql_stmt_affected_rows(statement->stmt);
+	}
+
+	lua_pushinteger(L, affected);
+	return 1;
+}
 
-					} else {
-						if (named_columns) {
-							LUA_PUSH_ATTRIB_STRING_BY_LENGTH(name, bind[i].buffer, *bind[i].length);
-						} else {
-							LUA_PUSH_ARRAY_STRING_BY_LENGTH(d, bind[i].buffer, *bind[i].length);
+/*
+ * available,err = statement:next_result()
+ *
+ * Moves on to the next result set of a statement returning several,
+ * such as a CALL. Returns false once there are no more.
+ */
+static int statement_next_result(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
+	MYSQL_RES *metadata;
+	int status;
+
+	if (!statement->stmt) {
+		luaL_error(L, DBI_ERR_INVALID_STATEMENT);
+	}
+
+	forget_results(statement);
+	statement->has_result = 0;
+
+	/*
+	 * discards the rest of the current result, including any rows
+	 * a streamed statement has left on the server
+	 */
+	mysql_stmt_free_result(statement->stmt);
+
+	do {
+		/*
+		 * 0 when there is another result, -1 after the last
+		 */
+		status = mysql_stmt_next_result(statement->stmt);
+
+		if (status < 0) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+
+		if (status > 0) {
+			lua_pushboolean(L, 0);
+			lua_pushfstring(L, DBI_ERR_BINDING_EXEC, mysql_stmt_error(statement->stmt));
+			return 2;
+		}
+
+		/*
+		 * skip results without columns, like the status that ends
+		 * the results of a CALL
+		 */
+	} while (mysql_stmt_field_count(statement->stmt) == 0);
+
+	metadata = mysql_stmt_result_metadata(statement->stmt);
+
+	if (!metadata || (!statement->stream && mysql_stmt_store_result(statement->stmt))) {
+		if (metadata)
+			mysql_free_result(metadata);
+
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BINDING_EXEC, mysql_stmt_error(statement->stmt));
+		return 2;
+	}
+
+	statement->metadata = metadata;
+
+	if (bind_results(statement)) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BINDING_RESULTS, mysql_stmt_error(statement->stmt));
+		return 2;
+	}
+
+	statement->has_result = 1;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * pushes the row fetched into the result buffers, given the status
+ * mysql_stmt_fetch() returned, or nil if there was none
+ */
+static int push_row(lua_State *L, statement_t *statement, int fetch_result_ok, int named_columns) {
+	int column_count = statement->num_columns;
+	MYSQL_BIND *bind = statement->bind;
+
+	if (column_count > 0) {
+		int i;
+		int rebind = 0;
+		MYSQL_FIELD *fields = statement->fields;
+
+		if (fetch_result_ok == 0 || fetch_result_ok == MYSQL_DATA_TRUNCATED) {
+			lua_createtable(L, named_columns ? 0 : column_count, named_columns ? column_count : 0);
+
+			for (i = 0; i < column_count; i++) {
+				if (named_columns)
+					lua_pushstring(L, fields[i].name);
+
+				if (statement->is_null[i] || !statement->decoders[i]) {
+					lua_pushnil(L);
+				} else {
+					if (statement->lengths[i] > bind[i].buffer_length) {
+						if (fetch_truncated(statement, i)) {
+							luaL_error(L, DBI_ERR_FETCH_FAILED, mysql_stmt_error(statement->stmt));
 						}
+
+						rebind = 1;
 					}
-				} else if (lua_push == LUA_PUSH_BOOLEAN) {
-					if (named_columns) {
-						LUA_PUSH_ATTRIB_BOOL(name, *(int *)(bind[i].buffer));
-					} else {
-						LUA_PUSH_ARRAY_BOOL(d, *(int *)(bind[i].buffer));
-					}
-				} else {
-					luaL_error(L, DBI_ERR_UNKNOWN_PUSH);
+
+					statement->decoders[i](L, &bind[i]);
 				}
+
+				if (named_columns)
+					lua_rawset(L, -3);
+				else
+					lua_rawseti(L, -2, i + 1);
 			}
 		} else {
 			lua_pushnil(L);
 		}
-	}
 
-cleanup:
+		/*
+		 * grown buffers have to be bound again before the
+		 * next row is fetched into them
+		 */
+		if (rebind && mysql_stmt_bind_result(statement->stmt, bind)) {
+			luaL_error(L, DBI_ERR_BINDING_RESULTS, mysql_stmt_error(statement->stmt));
+		}
+	} else {
+		lua_pushnil(L);
+	}
 
-	if (bind) {
-		int i;
+	return 1;
+}
 
-		for (i = 0; i < column_count; i++) {
-			free(bind[i].buffer);
-		}
+static int statement_fetch_impl(lua_State *L, statement_t *statement, int named_columns) {
+	if (!statement->stmt) {
+		luaL_error(L, DBI_ERR_FETCH_INVALID);
+		return 0;
+	}
 
-		free(is_null);
-		free(bind);
+	if (statement->async) {
+		luaL_error(L, DBI_ERR_ASYNC_PENDING);
+		return 0;
 	}
 
-	if (error_message) {
-		luaL_error(L, error_message, mysql_stmt_error(statement->stmt));
+	if (!statement->metadata || !statement->has_result) {
+		luaL_error(L, DBI_ERR_FETCH_NO_EXECUTE);
 		return 0;
 	}
 
-	return 1;
+	if (statement->num_columns == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	return push_row(L, statement, mysql_stmt_fetch(statement->stmt), named_columns);
 }
 
 static int next_iterator(lua_State *L) {
@@ -533,8 +1453,151 @@ static int statement_fetch(lua_State *L) {
 	return statement_fetch_impl(L, statement, named_columns);
 }
 
+#ifdef MYSQL_WAIT_READ
+/*
+ * success,err = statement:execute_async(...)
+ *
+ * Starts executing the statement without blocking, on a connection
+ * opened with DBD.MySQL.NewAsync. Call statement:poll() until it
+ * returns true before fetching.
+ */
+static int statement_execute_async(lua_State *L) {
+	return execute(L, 1);
+}
+
+/*
+ * success,err = statement:fetch_async(named_indexes)
+ *
+ * Starts fetching the next row without blocking, which is only
+ * needed for streamed statements. statement:poll() then returns
+ * true and the row, or nil after the last.
+ */
+static int statement_fetch_async(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
+
+	if (!statement->stmt) {
+		luaL_error(L, DBI_ERR_FETCH_INVALID);
+	}
+
+	if (statement->async) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_ASYNC_PENDING);
+		return 2;
+	}
+
+	if (!statement->metadata || !statement->has_result) {
+		luaL_error(L, DBI_ERR_FETCH_NO_EXECUTE);
+	}
+
+	statement->named_columns = lua_toboolean(L, 2);
+	statement->wait = mysql_stmt_fetch_start(&statement->result, statement->stmt);
+	statement->async = DBD_MYSQL_ASYNC_FETCH;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * ready,wait = statement:poll()
+ * ready,row = statement:poll()
+ *
+ * Returns true once a pending execute_async has completed, along
+ * with the row for fetch_async. Until then returns false and the
+ * condition to wait for: "read" or "write" on connection:socket(),
+ * or "timeout". Failures return nil and an error.
+ */
+static int statement_poll(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
+	int ret = statement->result;
+
+	if (!statement->async) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if (!statement->conn->mysql) {
+		lua_pushstring(L, DBI_ERR_STATEMENT_BROKEN);
+		lua_error(L);
+	}
+
+	for (;;) {
+		/*
+		 * a step that completed as it was started has no events to
+		 * wait for, and left its result in statement->result
+		 */
+		if (statement->wait) {
+			int events = dbd_mysql_resume_events(statement->wait);
+
+			switch (statement->async) {
+			case DBD_MYSQL_ASYNC_EXECUTE:
+				statement->wait = mysql_stmt_execute_cont(&ret, statement->stmt, events);
+				break;
+			case DBD_MYSQL_ASYNC_STORE:
+				statement->wait = mysql_stmt_store_result_cont(&ret, statement->stmt, events);
+				break;
+			default:
+				statement->wait = mysql_stmt_fetch_cont(&ret, statement->stmt, events);
+			}
+
+			if (statement->wait)
+				return dbd_mysql_push_wait(L, statement->wait);
+		}
+
+		switch (statement->async) {
+		case DBD_MYSQL_ASYNC_EXECUTE:
+			if (ret)
+				goto failed;
+
+			if (describe_result(statement)) {
+				statement->async = DBD_MYSQL_ASYNC_NONE;
+				lua_pushnil(L);
+				lua_pushfstring(L, DBI_ERR_BINDING_RESULTS, mysql_stmt_error(statement->stmt));
+				return 2;
+			}
+
+			if (statement->metadata && !statement->stream) {
+				statement->async = DBD_MYSQL_ASYNC_STORE;
+				statement->wait = mysql_stmt_store_result_start(&ret, statement->stmt);
+				continue;
+			}
+			break;
+		case DBD_MYSQL_ASYNC_STORE:
+			if (ret)
+				goto failed;
+			break;
+		default:
+			statement->async = DBD_MYSQL_ASYNC_NONE;
+
+			if (ret == 1) {
+				lua_pushnil(L);
+				lua_pushfstring(L, DBI_ERR_FETCH_FAILED, mysql_stmt_error(statement->stmt));
+				return 2;
+			}
+
+			lua_pushboolean(L, 1);
+			push_row(L, statement, ret, statement->named_columns);
+			return 2;
+		}
+
+		statement->async = DBD_MYSQL_ASYNC_NONE;
+		statement->has_result = 1;
+
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+failed:
+	statement->async = DBD_MYSQL_ASYNC_NONE;
+	lua_pushnil(L);
+	lua_pushfstring(L, DBI_ERR_BINDING_EXEC, mysql_stmt_error(statement->stmt));
+	return 2;
+}
+#endif
+
 /*
  * num_rows = statement:rowcount()
+ *
+ * For streamed statements only the rows fetched so far are counted
  */
 static int statement_rowcount(lua_State *L) {
 	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
@@ -548,6 +1611,124 @@ static int statement_rowcount(lua_State *L) {
 	return 1;
 }
 
+/*
+ * data,length = statement:read_column(column, offset, len)
+ *
+ * Reads up to len bytes at offset into a column of the current row,
+ * as a string, along with the full length of the value. At or past
+ * the end the data is empty, and NULL values return nil.
+ */
+static int statement_read_column(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
+	lua_Integer column = luaL_checkinteger(L, 2);
+	lua_Integer offset = luaL_checkinteger(L, 3);
+	lua_Integer len = luaL_checkinteger(L, 4);
+	MYSQL_BIND bind;
+	unsigned long length = 0;
+	my_bool is_null = 0;
+	char *buffer;
+
+	if (!statement->stmt) {
+		luaL_error(L, DBI_ERR_FETCH_INVALID);
+	}
+
+	if (!statement->metadata || !statement->has_result) {
+		luaL_error(L, DBI_ERR_FETCH_NO_EXECUTE);
+	}
+
+	luaL_argcheck(L, column >= 1 && column <= statement->num_columns, 2, "invalid column");
+	luaL_argcheck(L, offset >= 0, 3, "invalid offset");
+	luaL_argcheck(L, len > 0 && len <= INT_MAX, 4, "invalid length");
+
+	/*
+	 * scratch space, which the garbage collector frees
+	 */
+	buffer = (char *)lua_newuserdata(L, len);
+
+	memset(&bind, 0, sizeof(bind));
+	bind.buffer_type = MYSQL_TYPE_STRING;
+	bind.buffer = buffer;
+	bind.buffer_length = len;
+	bind.length = &length;
+	bind.is_null = &is_null;
+
+	if (mysql_stmt_fetch_column(statement->stmt, &bind, column - 1, offset)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_FETCH_FAILED, mysql_stmt_error(statement->stmt));
+		return 2;
+	}
+
+	if (is_null) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if ((unsigned long)offset >= length) {
+		lua_pushliteral(L, "");
+	} else {
+		unsigned long available = length - offset;
+
+		lua_pushlstring(L, buffer, available < (unsigned long)len ? available : (unsigned long)len);
+	}
+
+	lua_pushinteger(L, length);
+	return 2;
+}
+
+static int column_chunk_iterator(lua_State *L) {
+	lua_Integer offset = lua_tointeger(L, lua_upvalueindex(3));
+	size_t len;
+
+	lua_settop(L, 0);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_pushinteger(L, offset);
+	lua_pushvalue(L, lua_upvalueindex(4));
+
+	/*
+	 * NULL values have no chunks
+	 */
+	if (statement_read_column(L) == 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (lua_isnil(L, -2)) {
+		luaL_error(L, "%s", lua_tostring(L, -1));
+	}
+
+	lua_pop(L, 1);
+	lua_tolstring(L, -1, &len);
+
+	if (len == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushinteger(L, offset + len);
+	lua_replace(L, lua_upvalueindex(3));
+
+	return 1;
+}
+
+/*
+ * iterfunc = statement:column_chunks(column, [size])
+ *
+ * Iterates over a column of the current row size bytes at a time
+ */
+static int statement_column_chunks(lua_State *L) {
+	luaL_checkudata(L, 1, DBD_MYSQL_STATEMENT);
+	luaL_checkinteger(L, 2);
+	luaL_argcheck(L, luaL_optinteger(L, 3, DBD_MYSQL_PREALLOC_SIZE) > 0, 3, "invalid chunk size");
+
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushinteger(L, 0);
+	lua_pushinteger(L, luaL_optinteger(L, 3, DBD_MYSQL_PREALLOC_SIZE));
+	lua_pushcclosure(L, column_chunk_iterator, 4);
+	return 1;
+}
+
 /*
  * iterfunc = statement:rows(named_indexes)
  */
@@ -585,7 +1766,7 @@ static int statement_tostring(lua_State *L) {
 	return 1;
 }
 
-int dbd_mysql_statement_create(lua_State *L, connection_t *conn, const char *sql_query) {
+int dbd_mysql_statement_create(lua_State *L, connection_t *conn, const char *sql_query, int stream, unsigned long prefetch_rows, int epoch, int numeric, int deferred) {
 	unsigned long sql_len = strlen(sql_query);
 
 	statement_t *statement = NULL;
@@ -601,14 +1782,56 @@ int dbd_mysql_statement_create(lua_State *L, connection_t *conn, const char *sql
 	if (mysql_stmt_prepare(stmt, sql_query, sql_len)) {
 		lua_pushnil(L);
 		lua_pushfstring(L, DBI_ERR_PREP_STATEMENT, mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
 		return 2;
 	}
 
+	/*
+	 * statements from a lost session no longer execute, so a
+	 * reconnect is first noticed here
+	 */
+	dbd_mysql_restore_autocommit(conn);
+
+	if (prefetch_rows > 0) {
+		unsigned long cursor_type = CURSOR_TYPE_READ_ONLY;
+
+		if (mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &cursor_type) ||
+		    mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch_rows)) {
+			lua_pushnil(L);
+			lua_pushfstring(L, DBI_ERR_PREP_STATEMENT, mysql_stmt_error(stmt));
+			mysql_stmt_close(stmt);
+			return 2;
+		}
+
+		stream = 1;
+	}
+
 	statement = (statement_t *)lua_newuserdata(L, sizeof(statement_t));
 	statement->conn = conn;
 	statement->stmt = stmt;
 	statement->metadata = NULL;
+	statement->fields = NULL;
+	statement->cached = 0;
+	statement->has_result = 0;
+	statement->async = DBD_MYSQL_ASYNC_NONE;
+	statement->wait = 0;
+	statement->result = 0;
+	statement->named_columns = 0;
 	statement->lengths = NULL;
+	statement->bind = NULL;
+	statement->is_null = NULL;
+	statement->num_columns = 0;
+	statement->stream = stream;
+	statement->epoch = epoch;
+	statement->numeric = numeric;
+	statement->decoders = NULL;
+	statement->deferred = NULL;
+	statement->num_deferred = 0;
+	statement->insert = NULL;
+	statement->values_start = 0;
+	statement->values_len = 0;
+	statement->batch = NULL;
+	statement->batch_rows = 0;
 
 	/*
 	   mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, (int*)0);
@@ -617,6 +1840,43 @@ int dbd_mysql_statement_create(lua_State *L, connection_t *conn, const char *sql
 	luaL_getmetatable(L, DBD_MYSQL_STATEMENT);
 	lua_setmetatable(L, -2);
 
+	if (mysql_stmt_field_count(stmt) == 0 &&
+	    find_values(sql_query, mysql_stmt_param_count(stmt), &statement->values_start, &statement->values_len)) {
+		statement->insert = malloc(sql_len + 1);
+		if (!statement->insert) {
+			luaL_error(L, "out of memory");
+		}
+
+		memcpy(statement->insert, sql_query, sql_len + 1);
+	}
+
+	if (deferred) {
+		int count = mysql_stmt_field_count(stmt);
+		int n = dbd_rawlen(L, deferred);
+		int i;
+
+		statement->deferred = calloc(count ? count : 1, 1);
+		if (!statement->deferred) {
+			luaL_error(L, "out of memory");
+		}
+
+		statement->num_deferred = count;
+
+		for (i = 1; i <= n; i++) {
+			lua_Integer column;
+
+			lua_rawgeti(L, deferred, i);
+			column = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+
+			if (column < 1 || column > count) {
+				luaL_error(L, "invalid deferred column %d", (int)column);
+			}
+
+			statement->deferred[column - 1] = 1;
+		}
+	}
+
 	return 1;
 }
 
@@ -624,9 +1884,22 @@ int dbd_mysql_statement(lua_State *L) {
 	static const luaL_Reg statement_methods[] = {
 		{"affected", statement_affected},
 		{"close", statement_close},
+		{"column_chunks", statement_column_chunks},
 		{"columns", statement_columns},
 		{"execute", statement_execute},
+#ifdef MYSQL_WAIT_READ
+		{"execute_async", statement_execute_async},
+#endif
+		{"executemany", statement_executemany},
 		{"fetch", statement_fetch},
+#ifdef MYSQL_WAIT_READ
+		{"fetch_async", statement_fetch_async},
+#endif
+		{"next_result", statement_next_result},
+#ifdef MYSQL_WAIT_READ
+		{"poll", statement_poll},
+#endif
+		{"read_column", statement_read_column},
 		{"rowcount", statement_rowcount},
 		{"rows", statement_rows},
 		{NULL, NULL}
@@ -1,6 +1,24 @@
+/*
+ * for clock_gettime() under -std=c99
+ */
+#define _POSIX_C_SOURCE 200112L
+
 #include "dbd_postgresql.h"
 
-int dbd_postgresql_statement_create(lua_State *L, connection_t *conn, const char *sql_query);
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#endif
+
+int dbd_postgresql_statement_create(lua_State *L, connection_t *conn, const char *sql_query, int unnamed);
+void dbd_postgresql_evict(connection_t *conn, int keep);
+int dbd_postgresql_largeobject_open(lua_State *L, connection_t *conn, Oid oid, int mode);
+int dbd_postgresql_statement_create_async(lua_State *L, connection_t *conn, const char *sql_query);
+int dbd_postgresql_poll(connection_t *conn);
+PGresult *dbd_postgresql_result(connection_t *conn);
 
 static int run(connection_t *conn, const char *command) {
 	PGresult *result = PQexec(conn->postgresql, command);
@@ -34,11 +52,26 @@ static int rollback(connection_t *conn) {
 
 
 /*
- * connection = DBD.PostgreSQL.New(dbname, user, password, host, port)
+ * keyword/value slots for the positional connection arguments
  */
-static int connection_new(lua_State *L) {
+#define CONNECTION_PARAMS 6
+
+/*
+ * reads the connection arguments into NULL terminated libpq
+ * keyword/value arrays, which are kept on the Lua stack. The
+ * arguments are either (dbname, user, password, host, port), or a
+ * table of libpq connection keywords (keepalives, connect_timeout,
+ * target_session_attrs, ...) plus
+ *
+ *   conninfo   - a connection string or URI, which the other
+ *                keywords override
+ *   autocommit - start in autocommit mode, without a BEGIN
+ *
+ * dbname comes first so that a conninfo string passed as dbname can
+ * be overridden by the other arguments, as PQsetdbLogin did.
+ */
+static void connection_params(lua_State *L, const char ***keywords, const char ***values, int *autocommit) {
 	int n = lua_gettop(L);
-	connection_t *conn = NULL;
 
 	const char *host = NULL;
 	const char *user = NULL;
@@ -46,10 +79,83 @@ static int connection_new(lua_State *L) {
 	const char *db = NULL;
 	const char *port = NULL;
 
-	const char *options = NULL; /* TODO always NULL */
-	const char *tty = NULL; /* TODO always NULL */
+	const char **k;
+	const char **v;
+
+	if (lua_istable(L, 1)) {
+		int count = 0;
+		int anchored = 0;
+
+		lua_settop(L, 1);
+
+		/*
+		 * holds values converted to strings while they are in use
+		 */
+		lua_newtable(L);
+
+		lua_pushnil(L);
+		while (lua_next(L, 1)) {
+			count++;
+			lua_pop(L, 1);
+		}
+
+		k = (const char **)lua_newuserdata(L, (count + 2) * sizeof(char *));
+		v = (const char **)lua_newuserdata(L, (count + 2) * sizeof(char *));
+
+		k[0] = "dbname";
+		v[0] = NULL;
+		n = 1;
+
+		lua_pushnil(L);
+		while (lua_next(L, 1)) {
+			const char *key;
+			const char *value = NULL;
+
+			if (lua_type(L, -2) != LUA_TSTRING)
+				luaL_argerror(L, 1, "connection keywords must be strings");
 
-	char portbuf[18];
+			key = lua_tostring(L, -2);
+
+			if (strcmp(key, "autocommit") == 0) {
+				*autocommit = lua_toboolean(L, -1);
+				lua_pop(L, 1);
+				continue;
+			}
+
+			switch (lua_type(L, -1)) {
+			case LUA_TBOOLEAN:
+				value = lua_toboolean(L, -1) ? "1" : "0";
+				break;
+			case LUA_TNUMBER:
+				lua_pushvalue(L, -1);
+				value = lua_tostring(L, -1);
+				lua_rawseti(L, 2, ++anchored);
+				break;
+			case LUA_TSTRING:
+				value = lua_tostring(L, -1);
+				break;
+			default:
+				luaL_argerror(L, 1, lua_pushfstring(L, "invalid value for `%s'", key));
+			}
+
+			if (strcmp(key, "conninfo") == 0) {
+				v[0] = value;
+			} else {
+				k[n] = key;
+				v[n] = value;
+				n++;
+			}
+
+			lua_pop(L, 1);
+		}
+
+		k[n] = NULL;
+		v[n] = NULL;
+
+		*keywords = k;
+		*values = v;
+		return;
+	}
 
 	/* db, user, password, host, port */
 	switch (n) {
@@ -59,8 +165,7 @@ static int connection_new(lua_State *L) {
 			int pport = luaL_checkinteger(L, 5);
 
 			if (pport >= 1 && pport <= 65535) {
-				snprintf(portbuf, sizeof(portbuf), "%d", pport);
-				port = portbuf;
+				port = lua_pushfstring(L, "%d", pport);
 			} else {
 				luaL_error(L, DBI_ERR_INVALID_PORT, pport);
 			}
@@ -86,16 +191,98 @@ static int connection_new(lua_State *L) {
 		// fallthrough
 	}
 
+	k = (const char **)lua_newuserdata(L, CONNECTION_PARAMS * sizeof(char *));
+	v = (const char **)lua_newuserdata(L, CONNECTION_PARAMS * sizeof(char *));
+
+	k[0] = "dbname";    v[0] = db;
+	k[1] = "user";      v[1] = user;
+	k[2] = "password";  v[2] = password;
+	k[3] = "host";      v[3] = host;
+	k[4] = "port";      v[4] = port;
+	k[5] = NULL;        v[5] = NULL;
+
+	*keywords = k;
+	*values = v;
+}
+
+/*
+ * connection = DBD.PostgreSQL.New(dbname, user, password, host, port)
+ * connection = DBD.PostgreSQL.New{conninfo=..., keepalives=..., ...}
+ */
+static int connection_new(lua_State *L) {
+	connection_t *conn = NULL;
+	const char **keywords;
+	const char **values;
+	int autocommit = 0;
+
+	connection_params(L, &keywords, &values, &autocommit);
+
 	conn = (connection_t *)lua_newuserdata(L, sizeof(connection_t));
 
-	conn->postgresql = PQsetdbLogin(host, port, options, tty, db, user, password);
+	conn->postgresql = PQconnectdbParams(keywords, values, 1);
 	conn->statement_id = 0;
-	conn->autocommit = 0;
-	begin(conn);
+	conn->prepared = NULL;
+	conn->num_prepared = 0;
+	conn->size_prepared = 0;
+	conn->max_prepared = DBD_POSTGRESQL_MAX_PREPARED;
+	conn->prepared_clock = 0;
+	conn->autocommit = autocommit;
+	conn->connecting = 0;
+	conn->begin_pending = 0;
+	conn->last_id_valid = 0;
 
 	if (PQstatus(conn->postgresql) != CONNECTION_OK) {
 		lua_pushnil(L);
 		lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, PQerrorMessage(conn->postgresql));
+		PQfinish(conn->postgresql);
+		conn->postgresql = NULL;
+		return 2;
+	}
+
+	if (!autocommit)
+		begin(conn);
+
+	luaL_getmetatable(L, DBD_POSTGRESQL_CONNECTION);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+/*
+ * connection = DBD.PostgreSQL.NewAsync(dbname, user, password, host, port)
+ * connection = DBD.PostgreSQL.NewAsync{conninfo=..., keepalives=..., ...}
+ *
+ * Starts connecting without blocking. Wait for connection:socket()
+ * to become writable, then drive the connection with
+ * connection:connect_poll() until it returns true.
+ */
+static int connection_new_async(lua_State *L) {
+	connection_t *conn = NULL;
+	const char **keywords;
+	const char **values;
+	int autocommit = 0;
+
+	connection_params(L, &keywords, &values, &autocommit);
+
+	conn = (connection_t *)lua_newuserdata(L, sizeof(connection_t));
+
+	conn->postgresql = PQconnectStartParams(keywords, values, 1);
+	conn->statement_id = 0;
+	conn->prepared = NULL;
+	conn->num_prepared = 0;
+	conn->size_prepared = 0;
+	conn->max_prepared = DBD_POSTGRESQL_MAX_PREPARED;
+	conn->prepared_clock = 0;
+	conn->autocommit = autocommit;
+	conn->connecting = 1;
+	conn->begin_pending = 0;
+	conn->last_id_valid = 0;
+
+	if (!conn->postgresql || PQstatus(conn->postgresql) == CONNECTION_BAD) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, conn->postgresql ? PQerrorMessage(conn->postgresql) : "out of memory");
+		PQfinish(conn->postgresql);
+		conn->postgresql = NULL;
 		return 2;
 	}
 
@@ -105,6 +292,183 @@ static int connection_new(lua_State *L) {
 	return 1;
 }
 
+/*
+ * drives a command sent with one of the PQsend* functions. Returns
+ * 0 once the results can be read without blocking, 1 while waiting
+ * for the socket to become readable, 2 while waiting for it to become
+ * writable and -1 on error.
+ */
+int dbd_postgresql_poll(connection_t *conn) {
+	int flush = PQflush(conn->postgresql);
+
+	if (flush < 0)
+		return -1;
+
+	if (flush > 0)
+		return 2;
+
+	if (!PQconsumeInput(conn->postgresql))
+		return -1;
+
+	if (PQisBusy(conn->postgresql))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * collects all results of a completed asynchronous command. The
+ * first failed result is returned if there is one, otherwise the
+ * last result.
+ */
+PGresult *dbd_postgresql_result(connection_t *conn) {
+	PGresult *result = NULL;
+	PGresult *next;
+
+	while ((next = PQgetResult(conn->postgresql)) != NULL) {
+		if (result) {
+			ExecStatusType status = PQresultStatus(result);
+
+			if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+				/*
+				 * keep the first error
+				 */
+				PQclear(next);
+				continue;
+			}
+
+			PQclear(result);
+		}
+
+		result = next;
+	}
+
+	return result;
+}
+
+/*
+ * milliseconds since an arbitrary point, for measuring timeouts
+ */
+static unsigned long clock_ms(void) {
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*
+ * waits up to timeout_ms milliseconds (forever if negative) for the
+ * connection socket to become readable, or writable if for_write is
+ * set. Returns 1 when ready, 0 on timeout and -1 on error.
+ */
+int dbd_postgresql_wait(connection_t *conn, int for_write, int timeout_ms) {
+	int sock = PQsocket(conn->postgresql);
+	int res;
+
+	/*
+	 * poll() rather than select(), which cannot take descriptors
+	 * beyond FD_SETSIZE
+	 */
+#ifdef _WIN32
+	WSAPOLLFD pfd;
+
+	if (sock < 0)
+		return -1;
+
+	pfd.fd = (SOCKET)sock;
+	pfd.events = for_write ? POLLWRNORM : POLLRDNORM;
+	pfd.revents = 0;
+
+	res = WSAPoll(&pfd, 1, timeout_ms < 0 ? -1 : timeout_ms);
+#else
+	struct pollfd pfd;
+	unsigned long start = clock_ms();
+	int remaining = timeout_ms < 0 ? -1 : timeout_ms;
+
+	if (sock < 0)
+		return -1;
+
+	pfd.fd = sock;
+	pfd.events = for_write ? POLLOUT : POLLIN;
+
+	/*
+	 * a signal cuts the wait short, so it is resumed for the
+	 * time left
+	 */
+	for (;;) {
+		unsigned long elapsed;
+
+		pfd.revents = 0;
+		res = poll(&pfd, 1, remaining);
+
+		if (res >= 0 || errno != EINTR)
+			break;
+
+		if (timeout_ms < 0)
+			continue;
+
+		elapsed = clock_ms() - start;
+		if (elapsed >= (unsigned long)timeout_ms)
+			return 0;
+
+		remaining = timeout_ms - (int)elapsed;
+	}
+#endif
+
+	if (res < 0)
+		return -1;
+
+	return res > 0;
+}
+
+/*
+ * waits up to timeout_ms milliseconds in all for the asynchronous
+ * command in progress to complete. Returns 0 once the results can
+ * be collected without blocking, 1 on timeout and -1 on error.
+ */
+int dbd_postgresql_finish(connection_t *conn, int timeout_ms) {
+	unsigned long start = clock_ms();
+
+	for (;;) {
+		int state = dbd_postgresql_poll(conn);
+		unsigned long elapsed;
+
+		if (state <= 0)
+			return state;
+
+		elapsed = clock_ms() - start;
+		if (elapsed >= (unsigned long)timeout_ms)
+			return 1;
+
+		if (dbd_postgresql_wait(conn, state == 2, timeout_ms - (int)elapsed) < 0)
+			return -1;
+	}
+}
+
+/*
+ * asks the server to abandon the command in progress on the
+ * connection. Returns 0 on failure with the reason in err.
+ */
+int dbd_postgresql_cancel(connection_t *conn, char *err, int errlen) {
+	PGcancel *cancel = PQgetCancel(conn->postgresql);
+	int ok;
+
+	if (!cancel) {
+		snprintf(err, errlen, "%s", PQerrorMessage(conn->postgresql));
+		return 0;
+	}
+
+	ok = PQcancel(cancel, err, errlen);
+	PQfreeCancel(cancel);
+
+	return ok;
+}
+
 /*
  * success = connection:autocommit(on)
  */
@@ -148,10 +512,49 @@ static int connection_close(lua_State *L) {
 		conn->postgresql = NULL;
 	}
 
+	if (conn->prepared) {
+		int i;
+
+		for (i = 0; i < conn->num_prepared; i++)
+			free(conn->prepared[i].sql);
+
+		free(conn->prepared);
+		conn->prepared = NULL;
+		conn->num_prepared = 0;
+		conn->size_prepared = 0;
+	}
+
 	lua_pushboolean(L, disconnect);
 	return 1;
 }
 
+/*
+ * success,err = connection:cancel()
+ *
+ * Asks the server to abandon the command currently running on the
+ * connection, such as one started by statement:execute_async(). The
+ * command then fails with a cancellation error.
+ */
+static int connection_cancel(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	char err[256];
+
+	if (!conn->postgresql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	if (!dbd_postgresql_cancel(conn, err, sizeof(err))) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 /*
  * success = connection:commit()
  */
@@ -172,6 +575,466 @@ static int connection_commit(lua_State *L) {
 	return 1;
 }
 
+/*
+ * ready,wait = connection:connect_poll()
+ *
+ * Drives a connection opened with DBD.PostgreSQL.NewAsync. Returns
+ * true once the connection is usable, or false and "read"/"write"
+ * naming the socket condition to wait for.
+ */
+static int connection_connect_poll(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	PGresult *result;
+	int state;
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	if (conn->connecting) {
+		switch (PQconnectPoll(conn->postgresql)) {
+		case PGRES_POLLING_READING:
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "read");
+			return 2;
+		case PGRES_POLLING_WRITING:
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "write");
+			return 2;
+		case PGRES_POLLING_FAILED:
+			lua_pushnil(L);
+			lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, PQerrorMessage(conn->postgresql));
+			return 2;
+		default:
+			break;
+		}
+
+		conn->connecting = 0;
+		PQsetnonblocking(conn->postgresql, 1);
+
+		/*
+		 * the transaction that New() opens with a blocking
+		 * BEGIN is sent asynchronously here
+		 */
+		if (!conn->autocommit) {
+			if (!PQsendQuery(conn->postgresql, "BEGIN")) {
+				lua_pushnil(L);
+				lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, PQerrorMessage(conn->postgresql));
+				return 2;
+			}
+
+			conn->begin_pending = 1;
+		}
+	}
+
+	if (conn->begin_pending) {
+		state = dbd_postgresql_poll(conn);
+
+		if (state < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, PQerrorMessage(conn->postgresql));
+			return 2;
+		}
+
+		if (state > 0) {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, state == 1 ? "read" : "write");
+			return 2;
+		}
+
+		conn->begin_pending = 0;
+		result = dbd_postgresql_result(conn);
+
+		if (result)
+			PQclear(result);
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * returns the FILE behind a Lua file handle at the given
+ * stack index, or NULL if it is not an open file
+ */
+static FILE *tofile(lua_State *L, int index) {
+	void *p = lua_touserdata(L, index);
+	FILE *file = NULL;
+
+	if (p && lua_getmetatable(L, index)) {
+		luaL_getmetatable(L, LUA_FILEHANDLE);
+
+		if (lua_rawequal(L, -1, -2)) {
+#if LUA_VERSION_NUM < 502
+			file = *(FILE **)p;
+#else
+			luaL_Stream *stream = (luaL_Stream *)p;
+
+			if (stream->closef)
+				file = stream->f;
+#endif
+		}
+
+		lua_pop(L, 2);
+	}
+
+	return file;
+}
+
+/*
+ * hands one COPY buffer to the sink - either the Lua function
+ * at stack index 3 or an open file. Returns an error message,
+ * or NULL on success.
+ */
+static const char *copy_sink(lua_State *L, FILE *file, const char *buffer, int len) {
+	if (file) {
+		if (fwrite(buffer, 1, len, file) != (size_t)len)
+			return "Error writing to file";
+
+		return NULL;
+	}
+
+	lua_pushvalue(L, 3);
+	lua_pushlstring(L, buffer, len);
+
+	if (lua_pcall(L, 1, 1, 0) != 0) {
+		/*
+		 * the error message stays on the stack, which
+		 * keeps it alive until we return
+		 */
+		const char *err = lua_tostring(L, -1);
+
+		return err ? err : "error in COPY callback";
+	}
+
+	/*
+	 * an explicit false from the callback aborts the COPY
+	 */
+	if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+		lua_pop(L, 1);
+		return "COPY aborted by sink";
+	}
+
+	lua_pop(L, 1);
+	return NULL;
+}
+
+/*
+ * rows,err = connection:copy_out(query, sink)
+ *
+ * Runs a COPY ... TO STDOUT query and streams the raw data buffers
+ * to sink, which is either a function called with each buffer or an
+ * open Lua file. No per-cell conversion is done. If the sink raises
+ * an error or returns false, it is not called again and the COPY
+ * completes without it.
+ */
+static int connection_copy_out(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	const char *query = luaL_checkstring(L, 2);
+	const char *errstr = NULL;
+	FILE *file = NULL;
+	PGresult *result;
+	char *buffer;
+	int rows = 0;
+	int len;
+
+	if (!lua_isfunction(L, 3)) {
+		file = tofile(L, 3);
+
+		if (!file)
+			luaL_argerror(L, 3, "function or open file expected");
+	}
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	conn->last_id_valid = 0;
+	result = PQexec(conn->postgresql, query);
+
+	if (!result) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_ALLOC_RESULT, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	if (PQresultStatus(result) != PGRES_COPY_OUT) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQresultErrorMessage(result));
+		PQclear(result);
+		return 2;
+	}
+
+	PQclear(result);
+
+	/*
+	 * once the sink fails the rest of the data is read and dropped.
+	 * Cancelling instead would abort an open transaction.
+	 */
+	while ((len = PQgetCopyData(conn->postgresql, &buffer, 0)) > 0) {
+		if (!errstr)
+			errstr = copy_sink(L, file, buffer, len);
+
+		PQfreemem(buffer);
+	}
+
+	if (len == -2 && !errstr) {
+		lua_pushstring(L, PQerrorMessage(conn->postgresql));
+		errstr = lua_tostring(L, -1);
+	}
+
+	/*
+	 * collect the final command status
+	 */
+	while ((result = PQgetResult(conn->postgresql)) != NULL) {
+		if (PQresultStatus(result) == PGRES_COMMAND_OK)
+			rows = atoi(PQcmdTuples(result));
+		else if (!errstr) {
+			lua_pushstring(L, PQresultErrorMessage(result));
+			errstr = lua_tostring(L, -1);
+		}
+
+		PQclear(result);
+	}
+
+	if (errstr) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, errstr);
+		return 2;
+	}
+
+	lua_pushinteger(L, rows);
+	return 1;
+}
+
+/*
+ * runs LISTEN or UNLISTEN for a channel, quoting it as an identifier
+ */
+static int listen_command(lua_State *L, connection_t *conn, const char *command, const char *channel) {
+	PGresult *result;
+	char *ident = NULL;
+	char *sql;
+	size_t len;
+
+	if (channel) {
+		ident = PQescapeIdentifier(conn->postgresql, channel, strlen(channel));
+
+		if (!ident) {
+			lua_pushboolean(L, 0);
+			lua_pushfstring(L, DBI_ERR_QUOTING_STR, PQerrorMessage(conn->postgresql));
+			return 2;
+		}
+	}
+
+	len = strlen(command) + (ident ? strlen(ident) : 1) + 2;
+	sql = malloc(len);
+	snprintf(sql, len, "%s %s", command, ident ? ident : "*");
+
+	if (ident)
+		PQfreemem(ident);
+
+	result = PQexec(conn->postgresql, sql);
+	free(sql);
+
+	if (!result) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_ALLOC_RESULT, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQresultErrorMessage(result));
+		PQclear(result);
+		return 2;
+	}
+
+	PQclear(result);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * success,err = connection:listen(channel)
+ *
+ * Without autocommit, LISTEN takes effect (and notifications are
+ * only delivered) when the transaction is committed.
+ */
+static int connection_listen(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	const char *channel = luaL_checkstring(L, 2);
+
+	if (!conn->postgresql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	return listen_command(L, conn, "LISTEN", channel);
+}
+
+/*
+ * success,err = connection:unlisten([channel])
+ *
+ * Stops listening on channel, or on all channels if none is given
+ */
+static int connection_unlisten(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	const char *channel = luaL_optstring(L, 2, NULL);
+
+	if (!conn->postgresql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	return listen_command(L, conn, "UNLISTEN", channel);
+}
+
+/*
+ * appends all queued notifications to the table on top of the
+ * stack. Returns the number added.
+ */
+static int push_notifications(lua_State *L, connection_t *conn, int d) {
+	PGnotify *notify;
+	int count = 0;
+
+	while ((notify = PQnotifies(conn->postgresql)) != NULL) {
+		lua_newtable(L);
+		LUA_PUSH_ATTRIB_STRING("channel", notify->relname);
+		LUA_PUSH_ATTRIB_STRING("payload", notify->extra);
+		LUA_PUSH_ATTRIB_INT("pid", notify->be_pid);
+		lua_rawseti(L, -2, d + count);
+
+		PQfreemem(notify);
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * list,err = connection:notifications([timeout_ms])
+ *
+ * Returns the pending notifications as a list of tables with
+ * channel, payload and pid fields. If none are pending, waits up to
+ * timeout_ms milliseconds for one to arrive (forever if negative).
+ */
+static int connection_notifications(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	int timeout_ms = luaL_optinteger(L, 2, 0);
+	int count;
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	lua_newtable(L);
+
+	if (!PQconsumeInput(conn->postgresql)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_FETCH_FAILED, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	count = push_notifications(L, conn, 1);
+
+	if (count == 0 && timeout_ms != 0) {
+		int ready = dbd_postgresql_wait(conn, 0, timeout_ms);
+
+		if (ready < 0 || (ready > 0 && !PQconsumeInput(conn->postgresql))) {
+			lua_pushnil(L);
+			lua_pushfstring(L, DBI_ERR_FETCH_FAILED, PQerrorMessage(conn->postgresql));
+			return 2;
+		}
+
+		push_notifications(L, conn, 1);
+	}
+
+	return 1;
+}
+
+/*
+ * oid,err = connection:lo_create([oid])
+ *
+ * Creates an empty large object, with the given oid if there is one
+ */
+static int connection_lo_create(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	Oid oid = (Oid)luaL_optinteger(L, 2, InvalidOid);
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	oid = lo_create(conn->postgresql, oid);
+
+	if (oid == InvalidOid) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	lua_pushinteger(L, oid);
+	return 1;
+}
+
+/*
+ * largeobject,err = connection:lo_open(oid, [mode])
+ *
+ * mode is "r" (the default), "w" or "rw". Large object descriptors
+ * only live until the end of the transaction, so this is of little
+ * use in autocommit mode.
+ */
+static int connection_lo_open(lua_State *L) {
+	static const int mode[] = {INV_READ, INV_WRITE, INV_READ | INV_WRITE};
+	static const char *const modenames[] = {"r", "w", "rw", NULL};
+
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	Oid oid = (Oid)luaL_checkinteger(L, 2);
+	int op = luaL_checkoption(L, 3, "r", modenames);
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	return dbd_postgresql_largeobject_open(L, conn, oid, mode[op]);
+}
+
+/*
+ * success,err = connection:lo_unlink(oid)
+ */
+static int connection_lo_unlink(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	Oid oid = (Oid)luaL_checkinteger(L, 2);
+
+	if (!conn->postgresql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	if (lo_unlink(conn->postgresql, oid) < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 /*
  * ok = connection:ping()
  */
@@ -191,13 +1054,23 @@ static int connection_ping(lua_State *L) {
 }
 
 /*
- * statement = connection:prepare(sql_string)
+ * statement = connection:prepare(sql_string, options)
+ *
+ * options.unnamed skips the server side prepare, sending the SQL
+ * with the parameters on each execute. Use it for one-off statements.
  */
 static int connection_prepare(lua_State *L) {
 	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	int unnamed = 0;
+
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "unnamed");
+		unnamed = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
 
 	if (conn->postgresql) {
-		return dbd_postgresql_statement_create(L, conn, luaL_checkstring(L, 2));
+		return dbd_postgresql_statement_create(L, conn, luaL_checkstring(L, 2), unnamed);
 	}
 
 	lua_pushnil(L);
@@ -255,11 +1128,144 @@ static int connection_rollback(lua_State *L) {
 }
 
 /*
- * last_id = connection:last_id()
+ * old_size = connection:statement_cache([size])
+ *
+ * Sets how many idle prepared statements are kept on the server for
+ * reuse. Least recently used ones beyond that are deallocated. 0
+ * deallocates every statement as soon as it is closed.
+ */
+static int connection_statement_cache(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	int old_size = conn->max_prepared;
+
+	if (!lua_isnoneornil(L, 2)) {
+		int size = luaL_checkinteger(L, 2);
+
+		luaL_argcheck(L, size >= 0, 2, "cache size must not be negative");
+
+		conn->max_prepared = size;
+
+		if (conn->postgresql)
+			dbd_postgresql_evict(conn, size);
+	}
+
+	lua_pushinteger(L, old_size);
+	return 1;
+}
+
+/*
+ * fd = connection:socket()
+ *
+ * The socket to wait on for asynchronous operations
+ */
+static int connection_socket(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	lua_pushinteger(L, PQsocket(conn->postgresql));
+	return 1;
+}
+
+/*
+ * statement = connection:prepare_async(sql_string)
+ *
+ * Sends the statement for preparation without waiting for the
+ * server. statement:poll() reports when it is ready to execute.
+ */
+static int connection_prepare_async(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+
+	if (conn->postgresql) {
+		return dbd_postgresql_statement_create_async(L, conn, luaL_checkstring(L, 2));
+	}
+
+	lua_pushnil(L);
+	lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+	return 2;
+}
+
+/*
+ * last_id,err = connection:last_id()
+ *
+ * The value most recently returned by nextval() in this session,
+ * typically the serial key of the last INSERT. The value is cached
+ * until another statement runs on the connection.
  */
 static int connection_lastid(lua_State *L) {
-	luaL_error(L, DBI_ERR_NOT_IMPLEMENTED, DBD_POSTGRESQL_CONNECTION, "last_id");
-	return 0;
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_CONNECTION);
+	PGresult *result;
+	PGresult *value = NULL;
+	PGresult *error = NULL;
+
+	if (!conn->postgresql) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	if (conn->last_id_valid) {
+		lua_pushinteger(L, (lua_Integer)conn->last_id);
+		return 1;
+	}
+
+	/*
+	 * lastval() fails until a sequence has been used, which would
+	 * abort an open transaction, so guard it with a savepoint. The
+	 * whole batch is still a single round trip.
+	 */
+	if (!PQsendQuery(conn->postgresql, conn->autocommit ? "SELECT lastval()" :
+	                 "SAVEPOINT dbd_lastval; SELECT lastval(); RELEASE SAVEPOINT dbd_lastval")) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	while ((result = PQgetResult(conn->postgresql)) != NULL) {
+		ExecStatusType status = PQresultStatus(result);
+
+		if (status == PGRES_TUPLES_OK && !value) {
+			value = result;
+		} else if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK && !error) {
+			error = result;
+		} else {
+			PQclear(result);
+		}
+	}
+
+	if (error) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQresultErrorMessage(error));
+		PQclear(error);
+
+		if (value)
+			PQclear(value);
+
+		if (!conn->autocommit)
+			run(conn, "ROLLBACK TO SAVEPOINT dbd_lastval; RELEASE SAVEPOINT dbd_lastval");
+
+		return 2;
+	}
+
+	if (!value || PQntuples(value) < 1) {
+		if (value)
+			PQclear(value);
+
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	conn->last_id = strtoll(PQgetvalue(value, 0, 0), NULL, 10);
+	conn->last_id_valid = 1;
+	PQclear(value);
+
+	lua_pushinteger(L, (lua_Integer)conn->last_id);
+	return 1;
 }
 
 /*
@@ -286,18 +1292,31 @@ static int connection_tostring(lua_State *L) {
 int dbd_postgresql_connection(lua_State *L) {
 	static const luaL_Reg connection_methods[] = {
 		{"autocommit", connection_autocommit},
+		{"cancel", connection_cancel},
 		{"close", connection_close},
 		{"commit", connection_commit},
+		{"connect_poll", connection_connect_poll},
+		{"copy_out", connection_copy_out},
 		{"ping", connection_ping},
 		{"prepare", connection_prepare},
+		{"prepare_async", connection_prepare_async},
 		{"quote", connection_quote},
 		{"rollback", connection_rollback},
 		{"last_id", connection_lastid},
+		{"listen", connection_listen},
+		{"lo_create", connection_lo_create},
+		{"lo_open", connection_lo_open},
+		{"lo_unlink", connection_lo_unlink},
+		{"notifications", connection_notifications},
+		{"socket", connection_socket},
+		{"statement_cache", connection_statement_cache},
+		{"unlisten", connection_unlisten},
 		{NULL, NULL}
 	};
 
 	static const luaL_Reg connection_class_methods[] = {
 		{"New", connection_new},
+		{"NewAsync", connection_new_async},
 		{NULL, NULL}
 	};
 
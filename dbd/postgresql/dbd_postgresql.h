@@ -1,4 +1,5 @@
 #include <libpq-fe.h>
+#include <libpq/libpq-fs.h>
 #include <dbd/common.h>
 
 /*
@@ -9,6 +10,40 @@
 
 #define DBD_POSTGRESQL_CONNECTION   "DBD.PostgreSQL.Connection"
 #define DBD_POSTGRESQL_STATEMENT    "DBD.PostgreSQL.Statement"
+#define DBD_POSTGRESQL_LARGEOBJECT  "DBD.PostgreSQL.LargeObject"
+
+/*
+ * default read size for largeobject:chunks()
+ */
+#define DBD_POSTGRESQL_LO_CHUNK     65536
+
+/*
+ * maximum number of dimensions of an array parameter, as for the server
+ */
+#define DBD_POSTGRESQL_MAX_ARRAY_DEPTH 6
+
+/*
+ * default number of idle prepared statements kept on the server
+ * for reuse by later prepare() calls with the same SQL
+ */
+#define DBD_POSTGRESQL_MAX_PREPARED 64
+
+/*
+ * how long a timed out execute() waits for the server to answer the
+ * cancel, whatever the statement timeout
+ */
+#define DBD_POSTGRESQL_CANCEL_GRACE_MS 5000
+
+/*
+ * server side prepared statement, shared by all statement
+ * handles created from the same SQL
+ */
+typedef struct _prepared {
+	char name[IDLEN];
+	char *sql;
+	int refs; /* statement handles using it */
+	unsigned int last_used;
+} prepared_t;
 
 /*
  * connection object implentation
@@ -17,6 +52,15 @@ typedef struct _connection {
 	PGconn *postgresql;
 	int autocommit;
 	unsigned int statement_id; /* sequence for statement IDs */
+	prepared_t *prepared; /* prepared statement cache */
+	int num_prepared;
+	int size_prepared;
+	int max_prepared;
+	unsigned int prepared_clock; /* LRU sequence */
+	int connecting; /* NewAsync connection still in progress */
+	int begin_pending; /* BEGIN sent asynchronously, result unread */
+	int last_id_valid; /* last_id holds lastval() since the last command */
+	long long last_id;
 } connection_t;
 
 /*
@@ -27,5 +71,30 @@ typedef struct _statement {
 	PGresult *result;
 	char name[IDLEN]; /* statement ID */
 	int tuple; /* number of rows returned */
+	char *sql; /* converted SQL, kept for cursors */
+	char cursor[IDLEN]; /* server side cursor name */
+	int cursor_open;
+	int fetch_size; /* rows per FETCH from the cursor, 0 if the
+	                   result is not from one */
+	int async; /* asynchronous operation in flight */
+	int timeout_ms; /* execute() time limit, 0 for none */
+	Oid *streams; /* large objects written for a pending execute_async() */
+	int num_streams;
 } statement_t;
 
+/*
+ * pending asynchronous operations on a statement
+ */
+#define DBD_POSTGRESQL_ASYNC_NONE       0
+#define DBD_POSTGRESQL_ASYNC_PREPARE    1
+#define DBD_POSTGRESQL_ASYNC_EXECUTE    2
+
+/*
+ * large object stream implementation
+ */
+typedef struct _largeobject {
+	connection_t *conn;
+	int fd; /* large object descriptor, -1 once closed */
+	char *buffer; /* read buffer, reused between reads */
+	size_t size;
+} largeobject_t;
@@ -0,0 +1,253 @@
+#include <limits.h>
+
+#include "dbd_postgresql.h"
+
+/*
+ * grows the read buffer of a large object handle to at least size
+ * bytes. Returns 0 if out of memory.
+ */
+static int reserve(largeobject_t *lo, size_t size) {
+	char *buffer;
+
+	if (size <= lo->size)
+		return 1;
+
+	buffer = realloc(lo->buffer, size);
+	if (!buffer)
+		return 0;
+
+	lo->buffer = buffer;
+	lo->size = size;
+
+	return 1;
+}
+
+static largeobject_t *check_open(lua_State *L) {
+	largeobject_t *lo = (largeobject_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_LARGEOBJECT);
+
+	if (lo->fd < 0) {
+		luaL_error(L, DBI_ERR_INVALID_LOB);
+	}
+
+	if (!lo->conn->postgresql) {
+		luaL_error(L, DBI_ERR_STATEMENT_BROKEN);
+	}
+
+	return lo;
+}
+
+/*
+ * data = largeobject:read(n)
+ *
+ * Returns up to n bytes, or nil at the end of the object
+ */
+static int largeobject_read(lua_State *L) {
+	largeobject_t *lo = check_open(L);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	int len;
+
+	luaL_argcheck(L, n > 0 && n <= INT_MAX, 2, "invalid read size");
+
+	if (!reserve(lo, n)) {
+		luaL_error(L, "out of memory");
+	}
+
+	len = lo_read(lo->conn->postgresql, lo->fd, lo->buffer, n);
+
+	if (len < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_FETCH_FAILED, PQerrorMessage(lo->conn->postgresql));
+		return 2;
+	}
+
+	if (len == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushlstring(L, lo->buffer, len);
+	return 1;
+}
+
+/*
+ * written = largeobject:write(data)
+ */
+static int largeobject_write(lua_State *L) {
+	largeobject_t *lo = check_open(L);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	int written;
+
+	written = lo_write(lo->conn->postgresql, lo->fd, data, len);
+
+	if (written < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(lo->conn->postgresql));
+		return 2;
+	}
+
+	lua_pushinteger(L, written);
+	return 1;
+}
+
+/*
+ * position = largeobject:seek([whence [, offset]])
+ *
+ * whence is "set", "cur" (the default) or "end", as for Lua files
+ */
+static int largeobject_seek(lua_State *L) {
+	static const int mode[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+	static const char *const modenames[] = {"set", "cur", "end", NULL};
+
+	largeobject_t *lo = check_open(L);
+	int op = luaL_checkoption(L, 2, "cur", modenames);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	pg_int64 pos;
+
+	pos = lo_lseek64(lo->conn->postgresql, lo->fd, offset, mode[op]);
+
+	if (pos < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(lo->conn->postgresql));
+		return 2;
+	}
+
+	lua_pushinteger(L, pos);
+	return 1;
+}
+
+/*
+ * success = largeobject:truncate(len)
+ */
+static int largeobject_truncate(lua_State *L) {
+	largeobject_t *lo = check_open(L);
+	lua_Integer len = luaL_checkinteger(L, 2);
+
+	if (lo_truncate64(lo->conn->postgresql, lo->fd, len) < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(lo->conn->postgresql));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int chunk_iterator(lua_State *L) {
+	lua_settop(L, 0);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, lua_upvalueindex(2));
+
+	return largeobject_read(L);
+}
+
+/*
+ * iterfunc = largeobject:chunks([size])
+ *
+ * Iterates over the rest of the object size bytes at a time
+ */
+static int largeobject_chunks(lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 2, DBD_POSTGRESQL_LO_CHUNK);
+
+	check_open(L);
+	luaL_argcheck(L, size > 0 && size <= INT_MAX, 2, "invalid chunk size");
+
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, size);
+	lua_pushcclosure(L, chunk_iterator, 2);
+	return 1;
+}
+
+/*
+ * success = largeobject:close()
+ */
+static int largeobject_close(lua_State *L) {
+	largeobject_t *lo = (largeobject_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_LARGEOBJECT);
+	int ok = 0;
+
+	if (lo->fd >= 0) {
+		/*
+		 * descriptors die with the transaction, and with the
+		 * connection, so failures here are not interesting
+		 */
+		if (lo->conn->postgresql)
+			ok = lo_close(lo->conn->postgresql, lo->fd) == 0;
+
+		lo->fd = -1;
+	}
+
+	if (lo->buffer) {
+		free(lo->buffer);
+		lo->buffer = NULL;
+		lo->size = 0;
+	}
+
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+/*
+ * __gc
+ */
+static int largeobject_gc(lua_State *L) {
+	largeobject_close(L);
+
+	return 0;
+}
+
+/*
+ * __tostring
+ */
+static int largeobject_tostring(lua_State *L) {
+	largeobject_t *lo = (largeobject_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_LARGEOBJECT);
+
+	lua_pushfstring(L, "%s: %p", DBD_POSTGRESQL_LARGEOBJECT, lo);
+
+	return 1;
+}
+
+int dbd_postgresql_largeobject_open(lua_State *L, connection_t *conn, Oid oid, int mode) {
+	largeobject_t *lo = NULL;
+	int fd;
+
+	fd = lo_open(conn->postgresql, oid, mode);
+
+	if (fd < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_OPEN_LOB, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	lo = (largeobject_t *)lua_newuserdata(L, sizeof(largeobject_t));
+	lo->conn = conn;
+	lo->fd = fd;
+	lo->buffer = NULL;
+	lo->size = 0;
+
+	luaL_getmetatable(L, DBD_POSTGRESQL_LARGEOBJECT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+int dbd_postgresql_largeobject(lua_State *L) {
+	static const luaL_Reg largeobject_methods[] = {
+		{"chunks", largeobject_chunks},
+		{"close", largeobject_close},
+		{"read", largeobject_read},
+		{"seek", largeobject_seek},
+		{"truncate", largeobject_truncate},
+		{"write", largeobject_write},
+		{NULL, NULL}
+	};
+
+	static const luaL_Reg largeobject_class_methods[] = {
+		{NULL, NULL}
+	};
+
+	dbd_register(L, DBD_POSTGRESQL_LARGEOBJECT,
+	             largeobject_methods, largeobject_class_methods,
+	             largeobject_gc, largeobject_tostring, largeobject_close);
+
+	return 1;
+}
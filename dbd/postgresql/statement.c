@@ -1,5 +1,10 @@
 #include "dbd_postgresql.h"
 
+int dbd_postgresql_poll(connection_t *conn);
+PGresult *dbd_postgresql_result(connection_t *conn);
+int dbd_postgresql_finish(connection_t *conn, int timeout_ms);
+int dbd_postgresql_cancel(connection_t *conn, char *err, int errlen);
+
 #define BOOLOID                 16
 #define INT2OID                 21
 #define INT4OID                 23
@@ -35,7 +40,7 @@ static lua_push_type_t postgresql_to_lua_push(unsigned int postgresql_type) {
 	return lua_type;
 }
 
-static int deallocate(statement_t *statement) {
+static int deallocate(connection_t *conn, const char *name) {
 	char command[IDLEN+13];
 	PGresult *result;
 	ExecStatusType status;
@@ -45,9 +50,9 @@ static int deallocate(statement_t *statement) {
 	 * - either by a mistake by the calling Lua program, or by
 	 * garbage collection. Don't die in that case.
 	 */
-	if (statement->conn->postgresql) {
-		snprintf(command, IDLEN+13, "DEALLOCATE \"%s\"", statement->name);
-		result = PQexec(statement->conn->postgresql, command);
+	if (conn->postgresql) {
+		snprintf(command, IDLEN+13, "DEALLOCATE \"%s\"", name);
+		result = PQexec(conn->postgresql, command);
 
 		if (!result)
 			return 1;
@@ -62,6 +67,457 @@ static int deallocate(statement_t *statement) {
 	return 0;
 }
 
+/*
+ * FNV-1a hash of the SQL text, used to name cached statements
+ */
+static unsigned long long sql_hash(const char *sql) {
+	unsigned long long hash = 14695981039346656037ULL;
+
+	while (*sql) {
+		hash ^= (unsigned char)*sql++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static prepared_t *find_prepared(connection_t *conn, const char *name) {
+	int i;
+
+	for (i = 0; i < conn->num_prepared; i++) {
+		if (strcmp(conn->prepared[i].name, name) == 0)
+			return &conn->prepared[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * deallocates the least recently used idle statements until no
+ * more than keep idle ones remain cached. Statements in use by a
+ * handle do not count.
+ */
+void dbd_postgresql_evict(connection_t *conn, int keep) {
+	int idle = 0;
+	int i;
+
+	for (i = 0; i < conn->num_prepared; i++) {
+		if (conn->prepared[i].refs == 0)
+			idle++;
+	}
+
+	while (idle > keep) {
+		prepared_t *lru = NULL;
+
+		for (i = 0; i < conn->num_prepared; i++) {
+			prepared_t *entry = &conn->prepared[i];
+
+			if (entry->refs == 0 && (!lru || entry->last_used < lru->last_used))
+				lru = entry;
+		}
+
+		/*
+		 * If DEALLOCATE fails the statement still exists on the
+		 * server, so it stays cached and can be reused.
+		 */
+		if (deallocate(conn, lru->name))
+			return;
+
+		free(lru->sql);
+		*lru = conn->prepared[--conn->num_prepared];
+		idle--;
+	}
+}
+
+/*
+ * marks the cached statement behind a handle as just used, so that
+ * statements executed often are the last to be evicted
+ */
+static void touch_prepared(statement_t *statement) {
+	prepared_t *entry;
+
+	if (!statement->name[0])
+		return;
+
+	entry = find_prepared(statement->conn, statement->name);
+
+	if (entry)
+		entry->last_used = ++statement->conn->prepared_clock;
+}
+
+/*
+ * remembers a newly prepared statement. Returns 0 if out of memory.
+ */
+static int add_prepared(connection_t *conn, const char *name, const char *sql) {
+	prepared_t *entry;
+
+	if (conn->num_prepared == conn->size_prepared) {
+		int size = conn->size_prepared ? conn->size_prepared * 2 : 8;
+		prepared_t *prepared = realloc(conn->prepared, size * sizeof(prepared_t));
+
+		if (!prepared)
+			return 0;
+
+		conn->prepared = prepared;
+		conn->size_prepared = size;
+	}
+
+	entry = &conn->prepared[conn->num_prepared];
+	entry->sql = malloc(strlen(sql) + 1);
+
+	if (!entry->sql)
+		return 0;
+
+	strcpy(entry->sql, sql);
+	strcpy(entry->name, name);
+	entry->refs = 1;
+	entry->last_used = ++conn->prepared_clock;
+	conn->num_prepared++;
+
+	return 1;
+}
+
+/*
+ * drops a statement handle's claim on its server side statement.
+ * Statements outside the cache are deallocated straight away.
+ */
+static void release_prepared(statement_t *statement) {
+	connection_t *conn = statement->conn;
+	prepared_t *entry;
+
+	if (!conn->postgresql || !statement->name[0])
+		return;
+
+	entry = find_prepared(conn, statement->name);
+
+	if (!entry) {
+		deallocate(conn, statement->name);
+		return;
+	}
+
+	entry->refs--;
+	dbd_postgresql_evict(conn, conn->max_prepared);
+}
+
+/*
+ * pushes the table at index idx as a PostgreSQL array literal, so
+ * that a Lua array can be bound as a single parameter, eg.
+ * "WHERE id = ANY($1)". Nested tables become multidimensional
+ * arrays. Returns an error message, with the stack unchanged, if
+ * the table can not be encoded.
+ */
+static const char *encode_array(lua_State *L, int idx, int depth, char *err, size_t errlen) {
+	int top = lua_gettop(L);
+	int len = dbd_rawlen(L, idx);
+	luaL_Buffer b;
+	const char *errstr;
+	const char *s;
+	size_t slen;
+	size_t j;
+	int i;
+
+	if (depth > DBD_POSTGRESQL_MAX_ARRAY_DEPTH) {
+		snprintf(err, errlen-1, "array nested too deeply");
+		return err;
+	}
+
+	luaL_checkstack(L, 4, "array parameter");
+	luaL_buffinit(L, &b);
+	luaL_addchar(&b, '{');
+
+	for (i = 1; i <= len; i++) {
+		if (i > 1)
+			luaL_addchar(&b, ',');
+
+		lua_rawgeti(L, idx, i);
+
+		switch (lua_type(L, -1)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			luaL_addstring(&b, "NULL");
+			break;
+		case LUA_TBOOLEAN:
+			s = lua_toboolean(L, -1) ? "1" : "0";
+			lua_pop(L, 1);
+			luaL_addstring(&b, s);
+			break;
+		case LUA_TNUMBER:
+			lua_tostring(L, -1);
+			luaL_addvalue(&b);
+			break;
+		case LUA_TSTRING:
+			/*
+			 * the string is still referenced by the table
+			 * so it outlives the pop
+			 */
+			s = lua_tolstring(L, -1, &slen);
+			lua_pop(L, 1);
+
+			/*
+			 * text parameters end at the first NUL, which
+			 * would silently cut the array short
+			 */
+			if (memchr(s, '\0', slen)) {
+				snprintf(err, errlen-1, "array element %d contains a NUL byte", i);
+				lua_settop(L, top);
+				return err;
+			}
+
+			luaL_addchar(&b, '"');
+			for (j = 0; j < slen; j++) {
+				if (s[j] == '"' || s[j] == '\\')
+					luaL_addchar(&b, '\\');
+				luaL_addchar(&b, s[j]);
+			}
+			luaL_addchar(&b, '"');
+			break;
+		case LUA_TTABLE:
+			errstr = encode_array(L, lua_gettop(L), depth + 1, err, errlen);
+			if (errstr) {
+				lua_settop(L, top);
+				return errstr;
+			}
+
+			lua_remove(L, -2);
+			luaL_addvalue(&b);
+			break;
+		default:
+			snprintf(err, errlen-1, DBI_ERR_BINDING_TYPE_ERR, lua_typename(L, lua_type(L, -1)));
+			lua_settop(L, top);
+			return err;
+		}
+	}
+
+	luaL_addchar(&b, '}');
+	luaL_pushresult(&b);
+
+	return NULL;
+}
+
+/*
+ * copies the DBI.stream() parameter at idx into a new large object,
+ * pushing its OID for an oid column and storing it in *created. The
+ * large object is created in the current transaction, or in one of its
+ * own in autocommit mode, so callers remove it with unlink_streams() if
+ * the statement then fails. Returns 0 on success.
+ */
+static int write_stream(lua_State *L, connection_t *conn, int idx, Oid *created, char *err, size_t errlen) {
+	PGresult *result;
+	Oid oid = InvalidOid;
+	int fd = -1;
+	int failed = 0;
+	char oidstr[16];
+
+	if (conn->autocommit) {
+		result = PQexec(conn->postgresql, "BEGIN");
+		failed = PQresultStatus(result) != PGRES_COMMAND_OK;
+		PQclear(result);
+
+		if (failed) {
+			snprintf(err, errlen, "%s", PQerrorMessage(conn->postgresql));
+			return 1;
+		}
+	}
+
+	oid = lo_creat(conn->postgresql, INV_READ | INV_WRITE);
+	if (oid != InvalidOid)
+		fd = lo_open(conn->postgresql, oid, INV_WRITE);
+
+	if (fd < 0) {
+		snprintf(err, errlen, "%s", PQerrorMessage(conn->postgresql));
+		failed = 1;
+	}
+
+	while (!failed) {
+		const char *data;
+		size_t len;
+
+		if (dbd_stream_read(L, idx)) {
+			snprintf(err, errlen, "%s", lua_tostring(L, -1));
+			lua_pop(L, 1);
+			failed = 1;
+			break;
+		}
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+
+		data = lua_tolstring(L, -1, &len);
+
+		if (len > 0 && lo_write(conn->postgresql, fd, data, len) != (int)len) {
+			snprintf(err, errlen, "%s", PQerrorMessage(conn->postgresql));
+			failed = 1;
+		}
+
+		lua_pop(L, 1);
+	}
+
+	if (fd >= 0)
+		lo_close(conn->postgresql, fd);
+
+	if (conn->autocommit) {
+		result = PQexec(conn->postgresql, failed ? "ROLLBACK" : "COMMIT");
+		if (!failed && PQresultStatus(result) != PGRES_COMMAND_OK) {
+			snprintf(err, errlen, "%s", PQerrorMessage(conn->postgresql));
+			failed = 1;
+		}
+		PQclear(result);
+	}
+
+	if (failed)
+		return 1;
+
+	*created = oid;
+
+	snprintf(oidstr, sizeof(oidstr), "%u", oid);
+	lua_pushstring(L, oidstr);
+
+	return 0;
+}
+
+/*
+ * removes the large objects written for stream parameters of a
+ * statement that failed, and frees the list
+ */
+static void unlink_streams(connection_t *conn, Oid *streams, int count) {
+	int i;
+
+	if (!streams)
+		return;
+
+	for (i = 0; i < count; i++) {
+		if (streams[i] != InvalidOid && conn->postgresql)
+			lo_unlink(conn->postgresql, streams[i]);
+	}
+
+	free(streams);
+}
+
+/*
+ * settles the streams of a completed execute_async(), removing their
+ * large objects unless it succeeded
+ */
+static void finish_streams(statement_t *statement, int succeeded) {
+	if (succeeded)
+		free(statement->streams);
+	else
+		unlink_streams(statement->conn, statement->streams, statement->num_streams);
+
+	statement->streams = NULL;
+	statement->num_streams = 0;
+}
+
+/*
+ * converts the Lua values at stack positions first..last into
+ * the string array expected by libpq. Returns an error message
+ * (in err) on failure, or NULL.
+ */
+static const char *bind_params(lua_State *L, connection_t *conn, int first, int last, const char **params, Oid *streams, char *err, size_t errlen) {
+	int p;
+
+	for (p = first; p <= last; p++) {
+		int i = p - first;
+		int type = lua_type(L, p);
+
+		switch(type) {
+		case LUA_TNIL:
+			params[i] = NULL;
+			break;
+		case LUA_TBOOLEAN:
+			/*
+			 * boolean values in postgresql can either be
+			 * t/f or 1/0. Pass integer values rather than
+			 * strings to maintain semantic compatibility
+			 * with other DBD drivers that pass booleans
+			 * as integers.
+			 */
+			params[i] = lua_toboolean(L, p) ?  "1" : "0";
+			break;
+		case LUA_TNUMBER:
+		case LUA_TSTRING:
+			params[i] = lua_tostring(L, p);
+			break;
+		case LUA_TTABLE:
+			/*
+			 * replace the table with its encoding, which
+			 * keeps the string alive until we return
+			 */
+			if (dbd_is_stream(L, p)) {
+				if (write_stream(L, conn, p, &streams[i], err, errlen))
+					return err;
+			} else if (encode_array(L, p, 1, err, errlen)) {
+				return err;
+			}
+
+			lua_replace(L, p);
+			params[i] = lua_tostring(L, p);
+			break;
+		default:
+			snprintf(err, errlen-1, DBI_ERR_BINDING_TYPE_ERR, lua_typename(L, type));
+			return err;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * closes the server side cursor opened by statement:open_cursor()
+ */
+static void close_cursor(statement_t *statement) {
+	char command[IDLEN+9];
+	PGresult *result;
+
+	if (!statement->cursor_open)
+		return;
+
+	statement->cursor_open = 0;
+
+	if (statement->conn->postgresql) {
+		snprintf(command, sizeof(command), "CLOSE \"%s\"", statement->cursor);
+		result = PQexec(statement->conn->postgresql, command);
+
+		if (result)
+			PQclear(result);
+	}
+}
+
+/*
+ * replaces the current result with the next batch of rows from
+ * the cursor. Returns 0 on failure.
+ */
+static int fetch_cursor(statement_t *statement) {
+	char command[IDLEN+32];
+	PGresult *result;
+
+	snprintf(command, sizeof(command), "FETCH %d FROM \"%s\"", statement->fetch_size, statement->cursor);
+	result = PQexec(statement->conn->postgresql, command);
+
+	if (!result)
+		return 0;
+
+	if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+		PQclear(result);
+		close_cursor(statement);
+		return 0;
+	}
+
+	if (statement->result)
+		PQclear(statement->result);
+
+	statement->result = result;
+	statement->tuple = 0;
+
+	/*
+	 * a short batch means the cursor is exhausted
+	 */
+	if (PQntuples(result) < statement->fetch_size)
+		close_cursor(statement);
+
+	return 1;
+}
 
 /*
  * num_affected_rows = statement:affected()
@@ -84,13 +540,42 @@ static int statement_affected(lua_State *L) {
 static int statement_close(lua_State *L) {
 	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
 
-	if (statement->result) {
+	if (statement->async) {
 		/*
-		 * Deallocate prepared statement on the
-		 * server side
+		 * the connection cannot be reused until the
+		 * outstanding results have been read
 		 */
-		deallocate(statement);
+		int ok = 0;
+
+		if (statement->conn->postgresql) {
+			PGresult *result = dbd_postgresql_result(statement->conn);
+
+			if (result) {
+				ExecStatusType status = PQresultStatus(result);
+
+				ok = status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+				PQclear(result);
+			}
+		}
+
+		statement->async = DBD_POSTGRESQL_ASYNC_NONE;
+		finish_streams(statement, ok);
+	}
+
+	close_cursor(statement);
+
+	if (statement->sql) {
+		/*
+		 * Release (and possibly deallocate) the prepared
+		 * statement on the server side
+		 */
+		release_prepared(statement);
+
+		free(statement->sql);
+		statement->sql = NULL;
+	}
 
+	if (statement->result) {
 		PQclear(statement->result);
 		statement->result = NULL;
 	}
@@ -118,113 +603,353 @@ static int statement_columns(lua_State *L) {
 	for (i = 0; i < num_columns; i++) {
 		const char *name = PQfname(statement->result, i);
 
-		LUA_PUSH_ARRAY_STRING(d, name);
+		LUA_PUSH_ARRAY_STRING(d, name);
+	}
+
+	return 1;
+}
+
+/*
+ * runs the statement as statement:execute() does, but cancels it on
+ * the server if it has not completed within the statement timeout.
+ * timed_out is set to 1 when that happens, or to 2 if the cancel
+ * also goes unanswered.
+ */
+static PGresult *execute_timeout(statement_t *statement, int num_bind_params, const char **params, int *timed_out) {
+	connection_t *conn = statement->conn;
+	char err[256];
+	int sent;
+
+	PQsetnonblocking(conn->postgresql, 1);
+
+	if (statement->name[0]) {
+		sent = PQsendQueryPrepared(conn->postgresql, statement->name, num_bind_params, params, NULL, NULL, 0);
+	} else {
+		sent = PQsendQueryParams(conn->postgresql, statement->sql, num_bind_params, NULL, params, NULL, NULL, 0);
+	}
+
+	if (!sent)
+		return NULL;
+
+	if (dbd_postgresql_finish(conn, statement->timeout_ms) > 0) {
+		*timed_out = 1;
+		dbd_postgresql_cancel(conn, err, sizeof(err));
+
+		/*
+		 * once cancelled the server answers promptly, with an
+		 * error unless the command managed to complete first. If
+		 * it stays silent the connection is left busy with the
+		 * command for the caller to close.
+		 */
+		if (dbd_postgresql_finish(conn, DBD_POSTGRESQL_CANCEL_GRACE_MS) > 0) {
+			*timed_out = 2;
+			return NULL;
+		}
+	}
+
+	return dbd_postgresql_result(conn);
+}
+
+/*
+ * success = statement:execute(...)
+ */
+static int statement_execute(lua_State *L) {
+	int n = lua_gettop(L);
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
+	int num_bind_params = n - 1;
+	ExecStatusType status;
+	const char *errstr = NULL;
+	char err[256];
+
+	const char **params;
+	Oid *streams;
+	PGresult *result = NULL;
+	int timed_out = 0;
+
+
+	/*
+	 * Sanity check - is database still connected?
+	 */
+	if (PQstatus(statement->conn->postgresql) != CONNECTION_OK)
+	{
+		lua_pushstring(L, DBI_ERR_STATEMENT_BROKEN);
+		lua_error(L);
+	}
+
+
+	if (!statement->sql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_EXECUTE_INVALID);
+		return 2;
+	}
+
+	if (statement->async) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_ASYNC_PENDING);
+		return 2;
+	}
+
+	close_cursor(statement);
+	statement->fetch_size = 0;
+	statement->tuple = 0;
+	statement->conn->last_id_valid = 0;
+	touch_prepared(statement);
+
+	params = malloc(num_bind_params * sizeof(params));
+	memset(params, 0, num_bind_params * sizeof(params));
+	streams = calloc(num_bind_params, sizeof(Oid));
+
+	/*
+	 * convert and copy parameters into a string array
+	 */
+	errstr = bind_params(L, statement->conn, 2, n, params, streams, err, sizeof(err));
+	if (errstr)
+		goto cleanup;
+
+	if (statement->timeout_ms > 0) {
+		result = execute_timeout(statement, num_bind_params, params, &timed_out);
+	} else if (statement->name[0]) {
+		result = PQexecPrepared(
+			statement->conn->postgresql,
+			statement->name,
+			num_bind_params,
+			(const char **)params,
+			NULL,
+			NULL,
+			0
+			);
+	} else {
+		result = PQexecParams(
+			statement->conn->postgresql,
+			statement->sql,
+			num_bind_params,
+			NULL,
+			(const char **)params,
+			NULL,
+			NULL,
+			0
+			);
+	}
+
+cleanup:
+	free(params);
+
+	if (errstr) {
+		unlink_streams(statement->conn, streams, num_bind_params);
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BINDING_PARAMS, errstr);
+		return 2;
+	}
+
+	if (!result) {
+		lua_pushboolean(L, 0);
+		if (timed_out > 1)
+			lua_pushfstring(L, DBI_ERR_CANCEL_UNANSWERED, statement->timeout_ms);
+		else if (timed_out)
+			lua_pushfstring(L, DBI_ERR_EXECUTE_TIMEOUT, statement->timeout_ms);
+		else
+			lua_pushfstring(L, DBI_ERR_ALLOC_RESULT,  PQerrorMessage(statement->conn->postgresql));
+		unlink_streams(statement->conn, streams, num_bind_params);
+		return 2;
+	}
+
+	status = PQresultStatus(result);
+	if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+		lua_pushboolean(L, 0);
+		if (timed_out)
+			lua_pushfstring(L, DBI_ERR_EXECUTE_TIMEOUT, statement->timeout_ms);
+		else
+			lua_pushfstring(L, DBI_ERR_BINDING_EXEC, PQresultErrorMessage(result));
+		PQclear(result);
+		unlink_streams(statement->conn, streams, num_bind_params);
+		return 2;
+	}
+
+	free(streams);
+
+	if (statement->result) {
+		status = PQresultStatus (statement->result);
+		if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
+			PQclear (statement->result);
+	}
+	statement->result = result;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * success,err = statement:execute_async(...)
+ *
+ * Sends the statement without waiting for the results. Call
+ * statement:poll() until it returns true before fetching.
+ */
+static int statement_execute_async(lua_State *L) {
+	int n = lua_gettop(L);
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
+	int num_bind_params = n - 1;
+	const char *errstr = NULL;
+	char err[256];
+	int sent = 0;
+
+	const char **params;
+	Oid *streams;
+
+	if (PQstatus(statement->conn->postgresql) != CONNECTION_OK)
+	{
+		lua_pushstring(L, DBI_ERR_STATEMENT_BROKEN);
+		lua_error(L);
+	}
+
+	if (!statement->sql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_EXECUTE_INVALID);
+		return 2;
+	}
+
+	if (statement->async) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_ASYNC_PENDING);
+		return 2;
+	}
+
+	close_cursor(statement);
+	statement->fetch_size = 0;
+	statement->tuple = 0;
+	statement->conn->last_id_valid = 0;
+	touch_prepared(statement);
+
+	params = malloc(num_bind_params * sizeof(params));
+	memset(params, 0, num_bind_params * sizeof(params));
+	streams = calloc(num_bind_params, sizeof(Oid));
+
+	errstr = bind_params(L, statement->conn, 2, n, params, streams, err, sizeof(err));
+	if (errstr)
+		goto cleanup;
+
+	PQsetnonblocking(statement->conn->postgresql, 1);
+
+	if (statement->name[0]) {
+		sent = PQsendQueryPrepared(
+			statement->conn->postgresql,
+			statement->name,
+			num_bind_params,
+			(const char **)params,
+			NULL,
+			NULL,
+			0
+			);
+	} else {
+		sent = PQsendQueryParams(
+			statement->conn->postgresql,
+			statement->sql,
+			num_bind_params,
+			NULL,
+			(const char **)params,
+			NULL,
+			NULL,
+			0
+			);
+	}
+
+cleanup:
+	free(params);
+
+	if (errstr) {
+		unlink_streams(statement->conn, streams, num_bind_params);
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BINDING_PARAMS, errstr);
+		return 2;
+	}
+
+	if (!sent) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(statement->conn->postgresql));
+		unlink_streams(statement->conn, streams, num_bind_params);
+		return 2;
 	}
 
+	/*
+	 * kept until poll() knows whether the statement succeeded
+	 */
+	statement->streams = streams;
+	statement->num_streams = num_bind_params;
+	statement->async = DBD_POSTGRESQL_ASYNC_EXECUTE;
+
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
 /*
- * success = statement:execute(...)
+ * ready,wait = statement:poll()
+ *
+ * Returns true once a pending prepare_async or execute_async has
+ * completed, or false and "read"/"write" naming the condition to
+ * wait for on connection:socket(). Failures return nil and an error.
  */
-static int statement_execute(lua_State *L) {
-	int n = lua_gettop(L);
+static int statement_poll(lua_State *L) {
 	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
-	int num_bind_params = n - 1;
 	ExecStatusType status;
-	int p;
-	const char *errstr = NULL;
-
-	const char **params;
-	PGresult *result = NULL;
+	PGresult *result;
+	int pending;
+	int state;
 
+	if (!statement->async) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
 
-	/*
-	 * Sanity check - is database still connected?
-	 */
-	if (PQstatus(statement->conn->postgresql) != CONNECTION_OK)
-	{
+	if (!statement->conn->postgresql) {
 		lua_pushstring(L, DBI_ERR_STATEMENT_BROKEN);
 		lua_error(L);
 	}
 
+	state = dbd_postgresql_poll(statement->conn);
 
-	statement->tuple = 0;
-
-	params = malloc(num_bind_params * sizeof(params));
-	memset(params, 0, num_bind_params * sizeof(params));
-
-	/*
-	 * convert and copy parameters into a string array
-	 */
-	for (p = 2; p <= n; p++) {
-		int i = p - 2;
-		int type = lua_type(L, p);
-		char err[64];
-
-		switch(type) {
-		case LUA_TNIL:
-			params[i] = NULL;
-			break;
-		case LUA_TBOOLEAN:
-			/*
-			 * boolean values in postgresql can either be
-			 * t/f or 1/0. Pass integer values rather than
-			 * strings to maintain semantic compatibility
-			 * with other DBD drivers that pass booleans
-			 * as integers.
-			 */
-			params[i] = lua_toboolean(L, p) ?  "1" : "0";
-			break;
-		case LUA_TNUMBER:
-		case LUA_TSTRING:
-			params[i] = lua_tostring(L, p);
-			break;
-		default:
-			snprintf(err, sizeof(err)-1, DBI_ERR_BINDING_TYPE_ERR, lua_typename(L, type));
-			errstr = err;
-			goto cleanup;
-		}
+	if (state < 0) {
+		statement->async = DBD_POSTGRESQL_ASYNC_NONE;
+		finish_streams(statement, 0);
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, PQerrorMessage(statement->conn->postgresql));
+		return 2;
 	}
 
-	result = PQexecPrepared(
-		statement->conn->postgresql,
-		statement->name,
-		num_bind_params,
-		(const char **)params,
-		NULL,
-		NULL,
-		0
-		);
-
-cleanup:
-	free(params);
-
-	if (errstr) {
+	if (state > 0) {
 		lua_pushboolean(L, 0);
-		lua_pushfstring(L, DBI_ERR_BINDING_PARAMS, errstr);
+		lua_pushstring(L, state == 1 ? "read" : "write");
 		return 2;
 	}
 
+	pending = statement->async;
+	statement->async = DBD_POSTGRESQL_ASYNC_NONE;
+	result = dbd_postgresql_result(statement->conn);
+
 	if (!result) {
-		lua_pushboolean(L, 0);
-		lua_pushfstring(L, DBI_ERR_ALLOC_RESULT,  PQerrorMessage(statement->conn->postgresql));
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_ALLOC_RESULT, PQerrorMessage(statement->conn->postgresql));
+		finish_streams(statement, 0);
 		return 2;
 	}
 
 	status = PQresultStatus(result);
 	if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
-		lua_pushboolean(L, 0);
-		lua_pushfstring(L, DBI_ERR_BINDING_EXEC, PQresultErrorMessage(result));
+		lua_pushnil(L);
+		lua_pushfstring(L, pending == DBD_POSTGRESQL_ASYNC_PREPARE ? DBI_ERR_PREP_STATEMENT : DBI_ERR_BINDING_EXEC, PQresultErrorMessage(result));
+		PQclear(result);
+		finish_streams(statement, 0);
 		return 2;
 	}
 
-	if (statement->result) {
-		status = PQresultStatus (statement->result);
-		if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK)
-			PQclear (statement->result);
+	finish_streams(statement, 1);
+
+	if (pending == DBD_POSTGRESQL_ASYNC_PREPARE) {
+		PQclear(result);
+	} else {
+		if (statement->result)
+			PQclear(statement->result);
+
+		statement->result = result;
 	}
-	statement->result = result;
 
 	lua_pushboolean(L, 1);
 	return 1;
@@ -234,11 +959,16 @@ cleanup:
  * can only be called after an execute
  */
 static int statement_fetch_impl(lua_State *L, statement_t *statement, int named_columns) {
-	int tuple = statement->tuple++;
+	int tuple;
 	int i;
 	int num_columns;
 	int d = 1;
 
+	if (statement->async) {
+		luaL_error(L, DBI_ERR_ASYNC_PENDING);
+		return 0;
+	}
+
 	if (!statement->result) {
 		luaL_error(L, DBI_ERR_FETCH_INVALID);
 		return 0;
@@ -249,6 +979,18 @@ static int statement_fetch_impl(lua_State *L, statement_t *statement, int named_
 		return 1;
 	}
 
+	/*
+	 * refill from the server side cursor once the
+	 * current batch has been drained
+	 */
+	if (statement->cursor_open && statement->tuple >= PQntuples(statement->result)) {
+		if (!fetch_cursor(statement)) {
+			luaL_error(L, DBI_ERR_FETCH_FAILED, PQerrorMessage(statement->conn->postgresql));
+		}
+	}
+
+	tuple = statement->tuple++;
+
 	if (tuple >= PQntuples(statement->result)) {
 		lua_pushnil(L); /* no more results */
 		return 1;
@@ -342,7 +1084,148 @@ static int statement_fetch(lua_State *L) {
 }
 
 /*
- * num_rows = statement:rowcount()
+ * row,err = statement:execute_returning(...)
+ *
+ * Executes the statement and returns its first row, such as the
+ * output of an INSERT ... RETURNING, as an array. nil if there are
+ * no rows, or nil and an error if execution fails.
+ */
+static int statement_execute_returning(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
+
+	if (statement_execute(L) == 2) {
+		lua_pushnil(L);
+		lua_replace(L, -3);
+		return 2;
+	}
+
+	lua_pop(L, 1);
+
+	return statement_fetch_impl(L, statement, 0);
+}
+
+/*
+ * success,err = statement:open_cursor(fetch_size, ...)
+ *
+ * Executes the statement through a server side cursor. Rows are
+ * retrieved fetch_size at a time as fetch() drains each batch, so
+ * other statements may run on the connection in between. Without
+ * autocommit the cursor lives until the transaction ends.
+ */
+static int statement_open_cursor(lua_State *L) {
+	int n = lua_gettop(L);
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
+	int fetch_size = luaL_checkinteger(L, 2);
+	int num_bind_params = n - 2;
+	const char *errstr = NULL;
+	char err[256];
+
+	const char **params;
+	Oid *streams;
+	char *command;
+	size_t command_len;
+	PGresult *result = NULL;
+
+	luaL_argcheck(L, fetch_size > 0, 2, "fetch size must be positive");
+
+	if (!statement->sql) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_EXECUTE_INVALID);
+		return 2;
+	}
+
+	if (PQstatus(statement->conn->postgresql) != CONNECTION_OK)
+	{
+		lua_pushstring(L, DBI_ERR_STATEMENT_BROKEN);
+		lua_error(L);
+	}
+
+	if (statement->async) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_ASYNC_PENDING);
+		return 2;
+	}
+
+	close_cursor(statement);
+	statement->conn->last_id_valid = 0;
+
+	snprintf(statement->cursor, IDLEN, "dbd-pgcursor-%017u", ++statement->conn->statement_id);
+
+	/*
+	 * in autocommit mode there is no transaction to hold the
+	 * cursor open, so it has to survive the implicit commit
+	 */
+	command_len = strlen(statement->sql) + IDLEN + 48;
+	command = malloc(command_len);
+	snprintf(command, command_len, "DECLARE \"%s\" NO SCROLL CURSOR%s FOR %s",
+	         statement->cursor, statement->conn->autocommit ? " WITH HOLD" : "", statement->sql);
+
+	params = malloc(num_bind_params * sizeof(params));
+	memset(params, 0, num_bind_params * sizeof(params));
+	streams = calloc(num_bind_params, sizeof(Oid));
+
+	errstr = bind_params(L, statement->conn, 3, n, params, streams, err, sizeof(err));
+	if (errstr)
+		goto cleanup;
+
+	result = PQexecParams(
+		statement->conn->postgresql,
+		command,
+		num_bind_params,
+		NULL,
+		(const char **)params,
+		NULL,
+		NULL,
+		0
+		);
+
+cleanup:
+	free(params);
+	free(command);
+
+	if (errstr) {
+		unlink_streams(statement->conn, streams, num_bind_params);
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BINDING_PARAMS, errstr);
+		return 2;
+	}
+
+	if (!result) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_ALLOC_RESULT,  PQerrorMessage(statement->conn->postgresql));
+		unlink_streams(statement->conn, streams, num_bind_params);
+		return 2;
+	}
+
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BINDING_EXEC, PQresultErrorMessage(result));
+		PQclear(result);
+		unlink_streams(statement->conn, streams, num_bind_params);
+		return 2;
+	}
+
+	PQclear(result);
+	free(streams);
+
+	statement->cursor_open = 1;
+	statement->fetch_size = fetch_size;
+
+	if (!fetch_cursor(statement)) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_FETCH_FAILED, PQerrorMessage(statement->conn->postgresql));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * num_rows,err = statement:rowcount()
+ *
+ * Rows read through open_cursor() are not counted, as only the
+ * current batch is held
  */
 static int statement_rowcount(lua_State *L) {
 	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
@@ -351,6 +1234,12 @@ static int statement_rowcount(lua_State *L) {
 		luaL_error(L, DBI_ERR_INVALID_STATEMENT);
 	}
 
+	if (statement->fetch_size > 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_CURSOR_ROWCOUNT);
+		return 2;
+	}
+
 	lua_pushinteger(L, PQntuples(statement->result));
 
 	return 1;
@@ -372,6 +1261,33 @@ static int statement_rows(lua_State *L) {
 	return 1;
 }
 
+/*
+ * old_timeout = statement:timeout([timeout_ms])
+ *
+ * Limits how long statement:execute() waits for the server. A
+ * statement still running after timeout_ms milliseconds is
+ * cancelled and execute() fails; outside autocommit mode that also
+ * aborts the transaction. If the server does not answer the cancel
+ * within DBD_POSTGRESQL_CANCEL_GRACE_MS, execute() fails with the
+ * connection still busy, and it should be closed. 0, the default,
+ * waits forever.
+ */
+static int statement_timeout(lua_State *L) {
+	statement_t *statement = (statement_t *)luaL_checkudata(L, 1, DBD_POSTGRESQL_STATEMENT);
+	int old_timeout = statement->timeout_ms;
+
+	if (!lua_isnoneornil(L, 2)) {
+		int timeout_ms = luaL_checkinteger(L, 2);
+
+		luaL_argcheck(L, timeout_ms >= 0, 2, "timeout must not be negative");
+
+		statement->timeout_ms = timeout_ms;
+	}
+
+	lua_pushinteger(L, old_timeout);
+	return 1;
+}
+
 /*
  * __gc
  */
@@ -393,10 +1309,36 @@ static int statement_tostring(lua_State *L) {
 	return 1;
 }
 
-int dbd_postgresql_statement_create(lua_State *L, connection_t *conn, const char *sql_query) {
-	statement_t *statement = NULL;
+/*
+ * wraps a statement prepared under the given name in a new
+ * userdata. Takes ownership of sql.
+ */
+static statement_t *new_statement(lua_State *L, connection_t *conn, const char *name, char *sql) {
+	statement_t *statement = (statement_t *)lua_newuserdata(L, sizeof(statement_t));
+
+	statement->conn = conn;
+	statement->result = NULL;
+	statement->tuple = 0;
+	statement->sql = sql;
+	statement->cursor_open = 0;
+	statement->fetch_size = 0;
+	statement->async = DBD_POSTGRESQL_ASYNC_NONE;
+	statement->timeout_ms = 0;
+	statement->streams = NULL;
+	statement->num_streams = 0;
+	strncpy(statement->name, name, IDLEN-1);
+	statement->name[IDLEN-1] = '\0';
+
+	luaL_getmetatable(L, DBD_POSTGRESQL_STATEMENT);
+	lua_setmetatable(L, -2);
+
+	return statement;
+}
+
+int dbd_postgresql_statement_create(lua_State *L, connection_t *conn, const char *sql_query, int unnamed) {
 	ExecStatusType status;
 	PGresult *result = NULL;
+	prepared_t *entry = NULL;
 	char *new_sql;
 	char name[IDLEN];
 
@@ -405,16 +1347,42 @@ int dbd_postgresql_statement_create(lua_State *L, connection_t *conn, const char
 	 */
 	new_sql = dbd_replace_placeholders(L, '$', sql_query);
 
-	snprintf(name, IDLEN, "dbd-postgresql-%017u", ++conn->statement_id);
+	/*
+	 * one-off statements are sent with the parameters at execute
+	 * time, saving the prepare round trip
+	 */
+	if (unnamed) {
+		new_statement(L, conn, "", new_sql);
+		return 1;
+	}
 
-	result = PQprepare(conn->postgresql, name, new_sql, 0, NULL);
+	/*
+	 * cached statements are named after their SQL, so preparing the
+	 * same SQL again reuses the server side statement
+	 */
+	if (conn->max_prepared > 0) {
+		snprintf(name, IDLEN, "dbd-postgresql-h%016llx", sql_hash(new_sql));
+		entry = find_prepared(conn, name);
+
+		if (entry && strcmp(entry->sql, new_sql) == 0) {
+			entry->refs++;
+			entry->last_used = ++conn->prepared_clock;
+
+			new_statement(L, conn, name, new_sql);
+			return 1;
+		}
+	}
 
 	/*
-	 * free converted statement after use
+	 * hash collisions and uncached statements get a unique name
 	 */
-	free(new_sql);
+	if (conn->max_prepared <= 0 || entry)
+		snprintf(name, IDLEN, "dbd-postgresql-%017u", ++conn->statement_id);
+
+	result = PQprepare(conn->postgresql, name, new_sql, 0, NULL);
 
 	if (!result) {
+		free(new_sql);
 		lua_pushnil(L);
 		lua_pushfstring(L, DBI_ERR_ALLOC_STATEMENT, PQerrorMessage(conn->postgresql));
 		return 2;
@@ -427,20 +1395,46 @@ int dbd_postgresql_statement_create(lua_State *L, connection_t *conn, const char
 		lua_pushnil(L);
 		lua_pushfstring(L, DBI_ERR_PREP_STATEMENT, err_string);
 		PQclear(result);
+		free(new_sql);
 		return 2;
 	}
 
 	PQclear(result);
 
-	statement = (statement_t *)lua_newuserdata(L, sizeof(statement_t));
-	statement->conn = conn;
-	statement->result = NULL;
-	statement->tuple = 0;
-	strncpy(statement->name, name, IDLEN-1);
-	statement->name[IDLEN-1] = '\0';
+	if (conn->max_prepared > 0 && !entry && !add_prepared(conn, name, new_sql)) {
+		/*
+		 * out of memory: fall back to an uncached statement
+		 */
+		deallocate(conn, name);
+		new_statement(L, conn, "", new_sql);
+		return 1;
+	}
 
-	luaL_getmetatable(L, DBD_POSTGRESQL_STATEMENT);
-	lua_setmetatable(L, -2);
+	new_statement(L, conn, name, new_sql);
+
+	return 1;
+}
+
+int dbd_postgresql_statement_create_async(lua_State *L, connection_t *conn, const char *sql_query) {
+	statement_t *statement = NULL;
+	char *new_sql;
+	char name[IDLEN];
+
+	new_sql = dbd_replace_placeholders(L, '$', sql_query);
+
+	snprintf(name, IDLEN, "dbd-postgresql-%017u", ++conn->statement_id);
+
+	PQsetnonblocking(conn->postgresql, 1);
+
+	if (!PQsendPrepare(conn->postgresql, name, new_sql, 0, NULL)) {
+		free(new_sql);
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_ALLOC_STATEMENT, PQerrorMessage(conn->postgresql));
+		return 2;
+	}
+
+	statement = new_statement(L, conn, name, new_sql);
+	statement->async = DBD_POSTGRESQL_ASYNC_PREPARE;
 
 	return 1;
 }
@@ -451,9 +1445,14 @@ int dbd_postgresql_statement(lua_State *L) {
 		{"close", statement_close},
 		{"columns", statement_columns},
 		{"execute", statement_execute},
+		{"execute_async", statement_execute_async},
+		{"execute_returning", statement_execute_returning},
 		{"fetch", statement_fetch},
+		{"open_cursor", statement_open_cursor},
+		{"poll", statement_poll},
 		{"rowcount", statement_rowcount},
 		{"rows", statement_rows},
+		{"timeout", statement_timeout},
 		{NULL, NULL}
 	};
 
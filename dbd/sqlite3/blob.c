@@ -0,0 +1,258 @@
+#include <limits.h>
+
+#include "dbd_sqlite3.h"
+
+extern int try_begin_transaction(connection_t *conn);
+
+/*
+ * grows the read buffer of a blob handle to at least size bytes.
+ * Returns 0 if out of memory.
+ */
+static int reserve(blob_t *blob, size_t size) {
+	char *buffer;
+
+	if (size <= blob->size)
+		return 1;
+
+	buffer = realloc(blob->buffer, size);
+	if (!buffer)
+		return 0;
+
+	blob->buffer = buffer;
+	blob->size = size;
+
+	return 1;
+}
+
+static blob_t *check_open(lua_State *L) {
+	blob_t *blob = (blob_t *)luaL_checkudata(L, 1, DBD_SQLITE_BLOB);
+
+	if (!blob->blob) {
+		luaL_error(L, DBI_ERR_INVALID_LOB);
+	}
+
+	if (!blob->conn->sqlite) {
+		luaL_error(L, DBI_ERR_STATEMENT_BROKEN);
+	}
+
+	return blob;
+}
+
+/*
+ * data,err = blob:read(n, [offset])
+ *
+ * Returns up to n bytes from offset (0 by default), or nil past the
+ * end of the blob
+ */
+static int blob_read(lua_State *L) {
+	blob_t *blob = check_open(L);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	int size = sqlite3_blob_bytes(blob->blob);
+
+	luaL_argcheck(L, n > 0 && n <= INT_MAX, 2, "invalid read size");
+	luaL_argcheck(L, offset >= 0, 3, "invalid offset");
+
+	if (offset >= size) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (n > size - offset)
+		n = size - offset;
+
+	if (!reserve(blob, n)) {
+		luaL_error(L, "out of memory");
+	}
+
+	if (sqlite3_blob_read(blob->blob, blob->buffer, (int)n, (int)offset) != SQLITE_OK) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_FETCH_FAILED, sqlite3_errmsg(blob->conn->sqlite));
+		return 2;
+	}
+
+	lua_pushlstring(L, blob->buffer, n);
+	return 1;
+}
+
+/*
+ * success,err = blob:write(data, [offset])
+ *
+ * Blobs cannot change size, so the data must fit within the value
+ */
+static int blob_write(lua_State *L) {
+	blob_t *blob = check_open(L);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+
+	luaL_argcheck(L, offset >= 0 && offset <= INT_MAX, 3, "invalid offset");
+	luaL_argcheck(L, len <= INT_MAX, 2, "data too long");
+
+	if (sqlite3_blob_write(blob->blob, data, (int)len, (int)offset) != SQLITE_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_EXECUTE_FAILED, sqlite3_errmsg(blob->conn->sqlite));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * success,err = blob:reopen(rowid)
+ *
+ * Moves the handle to the same column of another row
+ */
+static int blob_reopen(lua_State *L) {
+	blob_t *blob = check_open(L);
+	sqlite3_int64 rowid = luaL_checkinteger(L, 2);
+
+	if (sqlite3_blob_reopen(blob->blob, rowid) != SQLITE_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_OPEN_LOB, sqlite3_errmsg(blob->conn->sqlite));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * bytes = blob:size()
+ */
+static int blob_size(lua_State *L) {
+	blob_t *blob = check_open(L);
+
+	lua_pushinteger(L, sqlite3_blob_bytes(blob->blob));
+	return 1;
+}
+
+/*
+ * closes the blob, taking it off the connection's list
+ */
+static int close_blob(blob_t *blob) {
+	blob_t **link;
+
+	for (link = &blob->conn->blobs; *link; link = &(*link)->next) {
+		if (*link == blob) {
+			*link = blob->next;
+			break;
+		}
+	}
+
+	blob->next = NULL;
+
+	return sqlite3_blob_close(blob->blob) == SQLITE_OK;
+}
+
+/*
+ * success = blob:close()
+ */
+static int blob_close(lua_State *L) {
+	blob_t *blob = (blob_t *)luaL_checkudata(L, 1, DBD_SQLITE_BLOB);
+	int ok = 0;
+
+	/*
+	 * connection:close() has already closed the blob if it was
+	 * still open
+	 */
+	if (blob->blob) {
+		ok = close_blob(blob);
+		blob->blob = NULL;
+	}
+
+	if (blob->buffer) {
+		free(blob->buffer);
+		blob->buffer = NULL;
+		blob->size = 0;
+	}
+
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+/*
+ * __gc
+ */
+static int blob_gc(lua_State *L) {
+	blob_close(L);
+
+	return 0;
+}
+
+/*
+ * __tostring
+ */
+static int blob_tostring(lua_State *L) {
+	blob_t *blob = (blob_t *)luaL_checkudata(L, 1, DBD_SQLITE_BLOB);
+
+	lua_pushfstring(L, "%s: %p", DBD_SQLITE_BLOB, blob);
+
+	return 1;
+}
+
+int dbd_sqlite3_blob_open(lua_State *L, connection_t *conn, const char *table, const char *column, sqlite3_int64 rowid, int writable) {
+	blob_t *blob = NULL;
+
+	/*
+	 * writes belong to the transaction, as for statements
+	 */
+	if (writable)
+		try_begin_transaction(conn);
+
+	blob = (blob_t *)lua_newuserdata(L, sizeof(blob_t));
+	blob->conn = conn;
+	blob->blob = NULL;
+	blob->buffer = NULL;
+	blob->size = 0;
+	blob->next = NULL;
+
+	if (sqlite3_blob_open(conn->sqlite, "main", table, column, rowid, writable, &blob->blob) != SQLITE_OK) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_OPEN_LOB, sqlite3_errmsg(conn->sqlite));
+		return 2;
+	}
+
+	blob->next = conn->blobs;
+	conn->blobs = blob;
+
+	luaL_getmetatable(L, DBD_SQLITE_BLOB);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+/*
+ * closes every blob still open on the connection, ahead of closing
+ * it. The handles are left closed, with their buffers freed by gc.
+ */
+void dbd_sqlite3_blob_close_all(connection_t *conn) {
+	while (conn->blobs) {
+		blob_t *blob = conn->blobs;
+
+		close_blob(blob);
+		blob->blob = NULL;
+	}
+}
+
+int dbd_sqlite3_blob(lua_State *L) {
+	static const luaL_Reg blob_methods[] = {
+		{"close", blob_close},
+		{"read", blob_read},
+		{"reopen", blob_reopen},
+		{"size", blob_size},
+		{"write", blob_write},
+		{NULL, NULL}
+	};
+
+	static const luaL_Reg blob_class_methods[] = {
+		{NULL, NULL}
+	};
+
+	dbd_register(L, DBD_SQLITE_BLOB,
+	             blob_methods, blob_class_methods,
+	             blob_gc, blob_tostring, blob_close);
+
+	return 1;
+}
@@ -1,6 +1,8 @@
 #include "dbd_sqlite3.h"
 
 int dbd_sqlite3_statement_create(lua_State *L, connection_t *conn, const char *sql_query);
+int dbd_sqlite3_blob_open(lua_State *L, connection_t *conn, const char *table, const char *column, sqlite3_int64 rowid, int writable);
+void dbd_sqlite3_blob_close_all(connection_t *conn);
 
 static int run(connection_t *conn, const char *command) {
 	int res = sqlite3_exec(conn->sqlite, command, NULL, NULL, NULL);
@@ -38,13 +40,163 @@ int try_begin_transaction(connection_t *conn) {
 }
 
 /*
- * connection,err = DBD.SQLite3.New(dbfile)
+ * returns the thread that Lua callbacks from SQLite run on. It is
+ * separate from whichever coroutine happens to call into SQLite.
+ */
+lua_State *dbd_sqlite3_callback_thread(lua_State *L, connection_t *conn) {
+	if (!conn->L) {
+		conn->L = lua_newthread(L);
+		conn->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	return conn->L;
+}
+
+static int busy_handler(void *data, int count) {
+	connection_t *conn = (connection_t *)data;
+	lua_State *L = conn->L;
+	int retry = 0;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, conn->busy_ref);
+	lua_pushinteger(L, count);
+
+	/*
+	 * a failing handler gives up
+	 */
+	if (lua_pcall(L, 1, 1, 0) == 0)
+		retry = lua_toboolean(L, -1);
+
+	lua_pop(L, 1);
+
+	return retry;
+}
+
+/*
+ * runs PRAGMA name = value, with the value at the top of the stack.
+ * Returns an SQLite result code.
+ */
+static int set_pragma(lua_State *L, connection_t *conn, const char *name) {
+	const char *c;
+	char *sql = NULL;
+	int res;
+
+	for (c = name; *c; c++) {
+		if (!(*c == '_' || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')))
+			luaL_argerror(L, 3, lua_pushfstring(L, "invalid pragma `%s'", name));
+	}
+
+	switch (lua_type(L, -1)) {
+	case LUA_TBOOLEAN:
+		sql = sqlite3_mprintf("PRAGMA %s = %d", name, lua_toboolean(L, -1));
+		break;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM > 502
+		if (lua_isinteger(L, -1)) {
+			sql = sqlite3_mprintf("PRAGMA %s = %lld", name, (sqlite3_int64)lua_tointeger(L, -1));
+			break;
+		}
+#endif
+		sql = sqlite3_mprintf("PRAGMA %s = %!.15g", name, (double)lua_tonumber(L, -1));
+		break;
+	case LUA_TSTRING:
+		sql = sqlite3_mprintf("PRAGMA %s = %Q", name, lua_tostring(L, -1));
+		break;
+	default:
+		luaL_argerror(L, 3, lua_pushfstring(L, "invalid value for pragma `%s'", name));
+	}
+
+	if (!sql)
+		return SQLITE_NOMEM;
+
+	res = sqlite3_exec(conn->sqlite, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+
+	return res;
+}
+
+/*
+ * applies the options table at index idx to a new connection.
+ * Returns an SQLite result code.
+ */
+static int connection_options(lua_State *L, connection_t *conn, int idx) {
+	static const char *const pragmas[] = {
+		"journal_mode", "synchronous", "cache_size", "mmap_size", "temp_store", NULL
+	};
+	int res = SQLITE_OK;
+	int i;
+
+	lua_getfield(L, idx, "busy_timeout");
+	if (!lua_isnil(L, -1)) {
+		if (lua_type(L, -1) != LUA_TNUMBER)
+			luaL_argerror(L, idx, "busy_timeout must be a number of milliseconds");
+
+		res = sqlite3_busy_timeout(conn->sqlite, (int)lua_tointeger(L, -1));
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "busy_handler");
+	if (!lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_isfunction(L, -1), idx, "busy_handler must be a function");
+
+		dbd_sqlite3_callback_thread(L, conn);
+		lua_pushvalue(L, -1);
+		conn->busy_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+		/*
+		 * replaces any busy_timeout
+		 */
+		res = sqlite3_busy_handler(conn->sqlite, busy_handler, conn);
+	}
+	lua_pop(L, 1);
+
+	for (i = 0; pragmas[i] && res == SQLITE_OK; i++) {
+		lua_getfield(L, idx, pragmas[i]);
+		if (!lua_isnil(L, -1))
+			res = set_pragma(L, conn, pragmas[i]);
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, idx, "pragmas");
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (res == SQLITE_OK && lua_next(L, -2)) {
+			if (lua_type(L, -2) != LUA_TSTRING)
+				luaL_argerror(L, idx, "pragma names must be strings");
+
+			res = set_pragma(L, conn, lua_tostring(L, -2));
+			lua_pop(L, 1);
+		}
+
+		if (res != SQLITE_OK)
+			lua_pop(L, 1); /* the key */
+	}
+	lua_pop(L, 1);
+
+	return res;
+}
+
+/*
+ * connection,err = DBD.SQLite3.New(dbfile, [flags], [options])
+ *
+ * options configure the connection before it is used:
+ *
+ *   busy_timeout - milliseconds to retry for while the database is
+ *                  locked, rather than failing with SQLITE_BUSY
+ *   busy_handler - function(count) called while it is locked, which
+ *                  returns true to retry. Replaces busy_timeout
+ *   journal_mode, synchronous, cache_size, mmap_size, temp_store
+ *                - the PRAGMAs of the same name
+ *   pragmas      - a table of any other PRAGMA names and values
+ *
+ * The options may also be passed in place of the flags.
  */
 static int connection_new(lua_State *L) {
 	int n = lua_gettop(L);
 
 	const char *db = NULL;
 	connection_t *conn = NULL;
+	int options = 0;
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
 	/* db */
 	switch(n) {
@@ -55,25 +207,39 @@ static int connection_new(lua_State *L) {
 		db = luaL_checkstring(L, 1);
 	}
 
-	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 	if (n >= 2) {
-		if (!lua_isnil(L, 2))
+		if (lua_istable(L, 2))
+			options = 2;
+		else if (!lua_isnil(L, 2))
 			flags = luaL_checkinteger(L, 2);
 	}
 
-	conn = (connection_t *)lua_newuserdata(L, sizeof(connection_t));
-
-	if (sqlite3_open_v2(db, &conn->sqlite, flags, NULL) != SQLITE_OK) {
-		lua_pushnil(L);
-		lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, sqlite3_errmsg(conn->sqlite));
-		return 2;
+	if (n >= 3 && !lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		options = 3;
 	}
 
+	conn = (connection_t *)lua_newuserdata(L, sizeof(connection_t));
+	conn->sqlite = NULL;
 	conn->autocommit = 0;
+	conn->blobs = NULL;
+	conn->L = NULL;
+	conn->thread_ref = LUA_NOREF;
+	conn->busy_ref = LUA_NOREF;
 
+	/*
+	 * closes the handle if the open or the options fail
+	 */
 	luaL_getmetatable(L, DBD_SQLITE_CONNECTION);
 	lua_setmetatable(L, -2);
 
+	if (sqlite3_open_v2(db, &conn->sqlite, flags, NULL) != SQLITE_OK ||
+	    (options && connection_options(L, conn, options) != SQLITE_OK)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, DBI_ERR_CONNECTION_FAILED, conn->sqlite ? sqlite3_errmsg(conn->sqlite) : "out of memory");
+		return 2;
+	}
+
 	return 1;
 }
 
@@ -98,6 +264,142 @@ static int connection_autocommit(lua_State *L) {
 }
 
 
+/*
+ * success,err = connection:backup_to(target, [pages_per_step], [sleep_ms], [progress])
+ *
+ * Copies the main database to the file named by target, or to the
+ * main database of another connection. pages_per_step pages are
+ * copied at a time (all of them by default), sleeping sleep_ms
+ * between steps so that other connections can use the database, and
+ * at least DBD_SQLITE_BACKUP_BUSY_MS while either database is locked.
+ * progress(remaining, total) is called after each step, and stops the
+ * backup if it returns false.
+ */
+static int connection_backup_to(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_SQLITE_CONNECTION);
+	int pages = luaL_optinteger(L, 3, -1);
+	int sleep_ms = luaL_optinteger(L, 4, 0);
+	sqlite3 *dest = NULL;
+	sqlite3_backup *backup;
+	const char *err = NULL;
+	int opened = 0;
+	int res;
+	int n;
+
+	luaL_argcheck(L, pages != 0, 3, "pages_per_step must be positive, or -1 for all");
+
+	if (!lua_isnoneornil(L, 5))
+		luaL_checktype(L, 5, LUA_TFUNCTION);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		opened = 1;
+		res = sqlite3_open_v2(lua_tostring(L, 2), &dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	} else {
+		connection_t *target = (connection_t *)luaL_checkudata(L, 2, DBD_SQLITE_CONNECTION);
+
+		luaL_argcheck(L, target != conn, 2, "cannot back up to the same connection");
+		dest = target->sqlite;
+		res = dest ? SQLITE_OK : SQLITE_MISUSE;
+	}
+
+	if (!conn->sqlite || !dest) {
+		if (opened)
+			sqlite3_close(dest);
+
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	if (res != SQLITE_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BACKUP, sqlite3_errmsg(dest));
+		sqlite3_close(dest);
+		return 2;
+	}
+
+	backup = sqlite3_backup_init(dest, "main", conn->sqlite, "main");
+
+	if (backup) {
+		do {
+			res = sqlite3_backup_step(backup, pages);
+
+			if (res != SQLITE_OK && res != SQLITE_DONE && res != SQLITE_BUSY && res != SQLITE_LOCKED)
+				break;
+
+			if (!lua_isnoneornil(L, 5)) {
+				lua_pushvalue(L, 5);
+				lua_pushinteger(L, sqlite3_backup_remaining(backup));
+				lua_pushinteger(L, sqlite3_backup_pagecount(backup));
+
+				if (lua_pcall(L, 2, 1, 0)) {
+					err = lua_tostring(L, -1);
+					break;
+				}
+
+				if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+					err = "cancelled";
+					break;
+				}
+
+				lua_pop(L, 1);
+			}
+
+			/*
+			 * a locked database is waited out rather than
+			 * spun on, whatever sleep_ms says
+			 */
+			if ((res == SQLITE_BUSY || res == SQLITE_LOCKED) && sleep_ms < DBD_SQLITE_BACKUP_BUSY_MS)
+				sqlite3_sleep(DBD_SQLITE_BACKUP_BUSY_MS);
+			else if (res != SQLITE_DONE && sleep_ms > 0)
+				sqlite3_sleep(sleep_ms);
+		} while (res != SQLITE_DONE);
+
+		/*
+		 * reports any error from the steps
+		 */
+		res = sqlite3_backup_finish(backup);
+	} else {
+		res = sqlite3_errcode(dest);
+	}
+
+	if (err || res != SQLITE_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_BACKUP, err ? err : sqlite3_errmsg(dest));
+		n = 2;
+	} else {
+		lua_pushboolean(L, 1);
+		n = 1;
+	}
+
+	if (opened)
+		sqlite3_close(dest);
+
+	return n;
+}
+
+/*
+ * blob,err = connection:blob_open(table, column, rowid, [writable])
+ *
+ * Opens the value of a column in the main database for reading, or
+ * writing in place, a piece at a time
+ */
+static int connection_blob_open(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_SQLITE_CONNECTION);
+	const char *table = luaL_checkstring(L, 2);
+	const char *column = luaL_checkstring(L, 3);
+	sqlite3_int64 rowid = luaL_checkinteger(L, 4);
+	int writable = lua_toboolean(L, 5);
+
+	if (!conn->sqlite) {
+		lua_pushnil(L);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	return dbd_sqlite3_blob_open(L, conn, table, column, rowid, writable);
+}
+
 /*
  * success = connection:close()
  */
@@ -106,16 +408,289 @@ static int connection_close(lua_State *L) {
 	int disconnect = 0;
 
 	if (conn->sqlite) {
+		/*
+		 * open blobs would keep the database from closing
+		 */
+		dbd_sqlite3_blob_close_all(conn);
 		rollback(conn);
 		sqlite3_close(conn->sqlite);
 		disconnect = 1;
 		conn->sqlite = NULL;
 	}
 
+	luaL_unref(L, LUA_REGISTRYINDEX, conn->busy_ref);
+	conn->busy_ref = LUA_NOREF;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, conn->thread_ref);
+	conn->thread_ref = LUA_NOREF;
+	conn->L = NULL;
+
 	lua_pushboolean(L, disconnect);
 	return 1;
 }
 
+/*
+ * pushes the arguments of a SQL function call
+ */
+static int push_values(lua_State *L, int argc, sqlite3_value **argv) {
+	int i;
+
+	if (!lua_checkstack(L, argc + 2))
+		return 0;
+
+	for (i = 0; i < argc; i++) {
+		switch (sqlite3_value_type(argv[i])) {
+		case SQLITE_NULL:
+			lua_pushnil(L);
+			break;
+		case SQLITE_INTEGER:
+			lua_pushinteger(L, sqlite3_value_int64(argv[i]));
+			break;
+		case SQLITE_FLOAT:
+			lua_pushnumber(L, sqlite3_value_double(argv[i]));
+			break;
+		case SQLITE_BLOB: {
+			const void *blob = sqlite3_value_blob(argv[i]);
+			lua_pushlstring(L, (const char *)blob, sqlite3_value_bytes(argv[i]));
+			break;
+		}
+		default: {
+			const unsigned char *text = sqlite3_value_text(argv[i]);
+			lua_pushlstring(L, (const char *)text, sqlite3_value_bytes(argv[i]));
+			break;
+		}
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * sets the result of a SQL function call from the value at the top of
+ * the stack
+ */
+static void set_result(lua_State *L, sqlite3_context *ctx) {
+	switch (lua_type(L, -1)) {
+	case LUA_TNIL:
+		sqlite3_result_null(ctx);
+		break;
+	case LUA_TBOOLEAN:
+		sqlite3_result_int(ctx, lua_toboolean(L, -1));
+		break;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM > 502
+		if (lua_isinteger(L, -1)) {
+			sqlite3_result_int64(ctx, lua_tointeger(L, -1));
+			break;
+		}
+#endif
+		sqlite3_result_double(ctx, lua_tonumber(L, -1));
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *str = lua_tolstring(L, -1, &len);
+		sqlite3_result_text(ctx, str, len, SQLITE_TRANSIENT);
+		break;
+	}
+	default:
+		sqlite3_result_error(ctx, lua_pushfstring(L, DBI_ERR_BINDING_TYPE_ERR, luaL_typename(L, -1)), -1);
+	}
+}
+
+static void result_error(lua_State *L, sqlite3_context *ctx) {
+	const char *err = lua_tostring(L, -1);
+
+	sqlite3_result_error(ctx, err ? err : "error in Lua function", -1);
+}
+
+static void call_function(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	function_t *func = (function_t *)sqlite3_user_data(ctx);
+	lua_State *L = func->conn->L;
+	int top = lua_gettop(L);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, func->func_ref);
+
+	if (!push_values(L, argc, argv)) {
+		sqlite3_result_error_nomem(ctx);
+	} else if (lua_pcall(L, argc, 1, 0)) {
+		result_error(L, ctx);
+	} else {
+		set_result(L, ctx);
+	}
+
+	lua_settop(L, top);
+}
+
+/*
+ * aggregates keep a registry reference to the value returned by the
+ * last step, or 0 before the first
+ */
+static void call_step(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	function_t *func = (function_t *)sqlite3_user_data(ctx);
+	lua_State *L = func->conn->L;
+	int top = lua_gettop(L);
+	int *state = (int *)sqlite3_aggregate_context(ctx, sizeof(int));
+
+	if (!state) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, func->func_ref);
+
+	if (*state)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, *state);
+	else
+		lua_pushnil(L);
+
+	if (!push_values(L, argc, argv)) {
+		sqlite3_result_error_nomem(ctx);
+	} else if (lua_pcall(L, argc + 1, 1, 0)) {
+		result_error(L, ctx);
+	} else {
+		if (*state)
+			luaL_unref(L, LUA_REGISTRYINDEX, *state);
+
+		*state = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_settop(L, top);
+}
+
+static void call_final(sqlite3_context *ctx) {
+	function_t *func = (function_t *)sqlite3_user_data(ctx);
+	lua_State *L = func->conn->L;
+	int top = lua_gettop(L);
+	int *state = (int *)sqlite3_aggregate_context(ctx, 0);
+
+	if (func->final_ref != LUA_NOREF)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, func->final_ref);
+
+	/*
+	 * no state if there were no rows
+	 */
+	if (state && *state) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, *state);
+		luaL_unref(L, LUA_REGISTRYINDEX, *state);
+		*state = 0;
+	} else {
+		lua_pushnil(L);
+	}
+
+	/*
+	 * without a final function the result is the last state
+	 */
+	if (func->final_ref == LUA_NOREF || lua_pcall(L, 1, 1, 0) == 0)
+		set_result(L, ctx);
+	else
+		result_error(L, ctx);
+
+	lua_settop(L, top);
+}
+
+static void destroy_function(void *data) {
+	function_t *func = (function_t *)data;
+	lua_State *L = func->conn->L;
+
+	if (L) {
+		luaL_unref(L, LUA_REGISTRYINDEX, func->func_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, func->final_ref);
+	}
+
+	free(func);
+}
+
+/*
+ * registers the function at func_idx, or the aggregate step at func_idx
+ * and final function at final_idx (0 for none)
+ */
+static int create_function(lua_State *L, connection_t *conn, const char *name, int nargs, int flags, int func_idx, int final_idx, int aggregate) {
+	function_t *func;
+	int res;
+
+	if (!conn->sqlite) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, DBI_ERR_DB_UNAVAILABLE);
+		return 2;
+	}
+
+	func = (function_t *)malloc(sizeof(function_t));
+	if (!func) {
+		luaL_error(L, "out of memory");
+	}
+
+	dbd_sqlite3_callback_thread(L, conn);
+
+	func->conn = conn;
+	lua_pushvalue(L, func_idx);
+	func->func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	func->final_ref = LUA_NOREF;
+
+	if (final_idx) {
+		lua_pushvalue(L, final_idx);
+		func->final_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	/*
+	 * SQLite frees func, including when this fails
+	 */
+	if (aggregate) {
+		res = sqlite3_create_function_v2(conn->sqlite, name, nargs, SQLITE_UTF8 | flags, func,
+		                                 NULL, call_step, call_final, destroy_function);
+	} else {
+		res = sqlite3_create_function_v2(conn->sqlite, name, nargs, SQLITE_UTF8 | flags, func,
+		                                 call_function, NULL, NULL, destroy_function);
+	}
+
+	if (res != SQLITE_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, DBI_ERR_CREATE_FUNCTION, name, sqlite3_errmsg(conn->sqlite));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * success,err = connection:create_function(name, nargs, func, [flags])
+ *
+ * Defines a SQL function calling func with the arguments, which may
+ * be any number if nargs is -1. flags may include SQLITE_DETERMINISTIC,
+ * allowing SQLite to evaluate calls with constant arguments once.
+ */
+static int connection_create_function(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_SQLITE_CONNECTION);
+	const char *name = luaL_checkstring(L, 2);
+	int nargs = luaL_checkinteger(L, 3);
+	int flags = luaL_optinteger(L, 5, 0);
+
+	luaL_checktype(L, 4, LUA_TFUNCTION);
+
+	return create_function(L, conn, name, nargs, flags, 4, 0, 0);
+}
+
+/*
+ * success,err = connection:create_aggregate(name, step, [final], [nargs], [flags])
+ *
+ * Defines an aggregate SQL function. step(state, ...) is called for
+ * each row with the value it returned for the previous row (nil for
+ * the first), and final(state) returns the result, which is the last
+ * state if there is no final function.
+ */
+static int connection_create_aggregate(lua_State *L) {
+	connection_t *conn = (connection_t *)luaL_checkudata(L, 1, DBD_SQLITE_CONNECTION);
+	const char *name = luaL_checkstring(L, 2);
+	int nargs = luaL_optinteger(L, 5, -1);
+	int flags = luaL_optinteger(L, 6, 0);
+
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	if (!lua_isnoneornil(L, 4))
+		luaL_checktype(L, 4, LUA_TFUNCTION);
+
+	return create_function(L, conn, name, nargs, flags, 3, lua_isnoneornil(L, 4) ? 0 : 4, 1);
+}
+
 /*
  * success = connection:commit()
  */
@@ -234,8 +809,12 @@ int dbd_sqlite3_connection(lua_State *L) {
 	 */
 	static const luaL_Reg connection_methods[] = {
 		{"autocommit", connection_autocommit},
+		{"backup_to", connection_backup_to},
+		{"blob_open", connection_blob_open},
 		{"close", connection_close},
 		{"commit", connection_commit},
+		{"create_aggregate", connection_create_aggregate},
+		{"create_function", connection_create_function},
 		{"ping", connection_ping},
 		{"prepare", connection_prepare},
 		{"quote", connection_quote},
@@ -257,7 +836,7 @@ int dbd_sqlite3_connection(lua_State *L) {
 	             connection_gc, connection_tostring, connection_close);
 
 	/*
-	 * Connection flag constants exported in our namespace
+	 * Connection and function flag constants exported in our namespace
 	 */
 	static const struct {
 		const char *name;
@@ -276,6 +855,15 @@ int dbd_sqlite3_connection(lua_State *L) {
 		{"SQLITE_OPEN_FULLMUTEX",    SQLITE_OPEN_FULLMUTEX},
 		{"SQLITE_OPEN_SHAREDCACHE",  SQLITE_OPEN_SHAREDCACHE},
 		{"SQLITE_OPEN_PRIVATECACHE", SQLITE_OPEN_PRIVATECACHE},
+#ifdef SQLITE_DETERMINISTIC
+		{"SQLITE_DETERMINISTIC",     SQLITE_DETERMINISTIC},
+#endif
+#ifdef SQLITE_DIRECTONLY
+		{"SQLITE_DIRECTONLY",        SQLITE_DIRECTONLY},
+#endif
+#ifdef SQLITE_INNOCUOUS
+		{"SQLITE_INNOCUOUS",         SQLITE_INNOCUOUS},
+#endif
 		{NULL, 0}
 	};
 
@@ -3,6 +3,12 @@
 
 #define DBD_SQLITE_CONNECTION   "DBD.SQLite3.Connection"
 #define DBD_SQLITE_STATEMENT    "DBD.SQLite3.Statement"
+#define DBD_SQLITE_BLOB         "DBD.SQLite3.Blob"
+
+/*
+ * minimum sleep between backup steps that found a database locked
+ */
+#define DBD_SQLITE_BACKUP_BUSY_MS 10
 
 /*
  * connection object
@@ -10,6 +16,10 @@
 typedef struct _connection {
 	sqlite3 *sqlite;
 	int autocommit;
+	lua_State *L;           /* thread running Lua callbacks */
+	int thread_ref;         /* anchors it */
+	int busy_ref;           /* busy handler function */
+	struct _blob *blobs;    /* open blob handles, closed with it */
 } connection_t;
 
 /*
@@ -22,3 +32,23 @@ typedef struct _statement {
 	int affected;
 } statement_t;
 
+/*
+ * incremental blob I/O handle
+ */
+typedef struct _blob {
+	connection_t *conn;
+	sqlite3_blob *blob; /* NULL once closed */
+	char *buffer; /* read buffer, reused between reads */
+	size_t size;
+	struct _blob *next; /* in the connection's list of open blobs */
+} blob_t;
+
+/*
+ * Lua SQL function, freed by SQLite when it is replaced or the
+ * connection closes
+ */
+typedef struct _function {
+	connection_t *conn;
+	int func_ref;   /* scalar function, or aggregate step */
+	int final_ref;  /* aggregate final, if any */
+} function_t;
@@ -106,6 +106,47 @@ static int statement_columns(lua_State *L) {
 	return 1;
 }
 
+/*
+ * replaces the DBI.stream() parameter at p with its whole value,
+ * as SQLite needs the length of a value when it is bound. Returns
+ * 0, or 1 with an error message pushed.
+ */
+static int read_stream(lua_State *L, int p) {
+	luaL_Buffer b;
+	int chunks = 0;
+	int t;
+	int i;
+
+	lua_newtable(L);
+	t = lua_gettop(L);
+
+	for (;;) {
+		if (dbd_stream_read(L, p)) {
+			lua_remove(L, -2);
+			return 1;
+		}
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+
+		lua_rawseti(L, t, ++chunks);
+	}
+
+	luaL_buffinit(L, &b);
+	for (i = 1; i <= chunks; i++) {
+		lua_rawgeti(L, t, i);
+		luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+
+	lua_replace(L, p);
+	lua_pop(L, 1);
+
+	return 0;
+}
+
 /*
  * success,err = statement:execute(...)
  */
@@ -115,6 +156,7 @@ static int statement_execute(lua_State *L) {
 	int p;
 	int errflag = 0;
 	const char *errstr = NULL;
+	char err[256];
 	int expected_params;
 	int num_bind_params = n - 1;
 
@@ -162,7 +204,6 @@ static int statement_execute(lua_State *L) {
 	for (p = 2; p <= n; p++) {
 		int i = p - 1;
 		int type = lua_type(L, p);
-		char err[64];
 
 		switch(type) {
 		case LUA_TNIL:
@@ -186,6 +227,27 @@ static int statement_execute(lua_State *L) {
 		case LUA_TBOOLEAN:
 			errflag = sqlite3_bind_int(statement->stmt, i, lua_toboolean(L, p)) != SQLITE_OK;
 			break;
+		case LUA_TTABLE:
+			if (dbd_is_stream(L, p)) {
+				size_t len;
+				const char *data;
+
+				if (read_stream(L, p)) {
+					errflag = 1;
+					snprintf(err, sizeof(err)-1, "%s", lua_tostring(L, -1));
+					errstr = err;
+					break;
+				}
+
+				/*
+				 * the value is only anchored until execute()
+				 * returns, and later steps may still read it
+				 */
+				data = lua_tolstring(L, p, &len);
+				errflag = sqlite3_bind_blob(statement->stmt, i, data, len, SQLITE_TRANSIENT) != SQLITE_OK;
+				break;
+			}
+			/* fallthrough */
 		default:
 			/*
 			 * Unknown/unsupported value type
@@ -656,6 +656,1019 @@ local function test_postgres_statement_leak()
 end
 
 
+local function test_postgres_copy_out()
+
+	local chunks = {}
+	local rows, err = dbh:copy_out("COPY select_tests (name) TO STDOUT", function(data)
+		table.insert(chunks, data)
+	end)
+
+	assert.is_nil(err)
+	assert.is_equal(3, rows)
+
+	local data = table.concat(chunks)
+	assert.is_not_nil(data:find("Row 1\n", 1, true))
+	assert.is_not_nil(data:find("Row 3\n", 1, true))
+
+	rows, err = dbh:copy_out("COPY select_tests TO STDOUT", function()
+		return false
+	end)
+
+	assert.is_nil(rows)
+	assert.is_string(err)
+
+	-- an aborted COPY leaves the transaction usable
+	dbh:autocommit(false)
+	finally(function() dbh:autocommit(true) end)
+
+	local calls = 0
+	rows, err = dbh:copy_out("COPY (select generate_series(1, 100000)) TO STDOUT", function()
+		calls = calls + 1
+		return false
+	end)
+
+	assert.is_nil(rows)
+	assert.is_string(err)
+	assert.equals(1, calls)
+
+	local sth = assert(dbh:prepare("select count(*) from select_tests"))
+	assert.is_true(sth:execute())
+	assert.equals(3, sth:fetch()[1])
+	sth:close()
+	assert.is_true(dbh:commit())
+
+end
+
+
+local function test_postgres_cursor()
+
+	local sth, err = dbh:prepare("select * from select_tests where maths > $1 order by id")
+	local count = 0
+	local success
+
+	assert.is_nil(err)
+	assert.is_not_nil(sth)
+
+	success, err = sth:open_cursor(2, 0)
+	assert.is_nil(err)
+	assert.is_true(success)
+
+	-- only the current batch is held, so the total is unknown
+	local rows
+	rows, err = sth:rowcount()
+	assert.is_nil(rows)
+	assert.is_string(err)
+
+	for row in sth:rows(true) do
+		count = count + 1
+		assert.equals('Row ' .. count, row['name'])
+
+		-- other statements may run while the cursor is open
+		local sth2 = dbh:prepare("select 1")
+		assert.is_true(sth2:execute())
+		sth2:close()
+	end
+
+	assert.equals(3, count)
+
+	-- a plain execute is counted again
+	assert.is_true(sth:execute(0))
+	assert.equals(3, sth:rowcount())
+	sth:close()
+
+end
+
+
+local function test_postgres_async()
+
+	local sth, err = dbh:prepare_async("select * from select_tests where name = $1")
+	local ready
+
+	assert.is_nil(err)
+	assert.is_not_nil(sth)
+	assert.is_number(dbh:socket())
+
+	repeat ready, err = sth:poll() until ready ~= false
+	assert.is_nil(err)
+	assert.is_true(ready)
+
+	assert.is_true(sth:execute_async("Row 1"))
+
+	-- results are not available until the statement has completed
+	assert.has_error(function()
+		sth:fetch()
+	end)
+
+	repeat ready, err = sth:poll() until ready ~= false
+	assert.is_nil(err)
+	assert.is_true(ready)
+
+	local row = sth:fetch(true)
+	assert.is_not_nil(row)
+	assert.equals('Row 1', row['name'])
+
+	sth:close()
+
+end
+
+
+local function test_postgres_notify()
+
+	local success, err = dbh:listen("luadbi test")
+	assert.is_nil(err)
+	assert.is_true(success)
+
+	local sth = dbh:prepare("select pg_notify('luadbi test', $1)")
+	assert.is_true(sth:execute("hello"))
+	sth:close()
+
+	local list
+	list, err = dbh:notifications(1000)
+	assert.is_nil(err)
+	assert.equals(1, #list)
+	assert.equals("luadbi test", list[1].channel)
+	assert.equals("hello", list[1].payload)
+	assert.is_number(list[1].pid)
+
+	assert.is_true(dbh:unlisten())
+	assert.equals(0, #dbh:notifications())
+
+end
+
+
+local function test_postgres_statement_cache()
+
+	local function count_prepared(sql)
+		local sth = dbh:prepare("select count(*) from pg_prepared_statements where statement = $1", { unnamed = true })
+		assert.is_true(sth:execute(sql))
+		local c = sth:fetch()[1]
+		sth:close()
+		return c
+	end
+
+	local sql = "select * from select_tests where id = $1"
+	local sth1 = assert(dbh:prepare(sql))
+	local sth2 = assert(dbh:prepare(sql))
+
+	-- both handles share a single server side statement
+	assert.equals(1, count_prepared(sql))
+
+	assert.is_true(sth1:execute(1))
+	assert.is_true(sth2:execute(2))
+	assert.equals('Row 1', sth1:fetch(true)['name'])
+	assert.equals('Row 2', sth2:fetch(true)['name'])
+
+	sth1:close()
+	sth2:close()
+
+	-- kept for reuse while the cache has room...
+	assert.equals(1, count_prepared(sql))
+
+	-- ...and deallocated once it does not
+	dbh:statement_cache(0)
+	assert.equals(0, count_prepared(sql))
+
+	-- only idle statements count, and executing one keeps it
+	-- from being the least recently used
+	dbh:statement_cache(1)
+	local sql2 = "select * from select_tests where name = $1"
+	sth1 = assert(dbh:prepare(sql))
+	sth2 = assert(dbh:prepare(sql2))
+	assert.is_true(sth2:execute('Row 2'))
+	assert.is_true(sth1:execute(1))
+	sth2:close()
+	sth1:close()
+	assert.equals(1, count_prepared(sql))
+	assert.equals(0, count_prepared(sql2))
+	dbh:statement_cache(64)
+
+end
+
+
+local function test_postgres_large_object()
+
+	-- large object descriptors only live inside a transaction, and
+	-- later tests expect the autocommit mode setup left
+	dbh:autocommit(false)
+	finally(function()
+		dbh:autocommit(true)
+	end)
+
+	local oid = assert(dbh:lo_create())
+	local lo = assert(dbh:lo_open(oid, "rw"))
+
+	local data = string.rep("0123456789", 1000)
+	assert.equals(#data, lo:write(data))
+	assert.equals(0, lo:seek("set"))
+	assert.equals("0123456789", lo:read(10))
+	assert.equals(#data, lo:seek("end"))
+	assert.is_nil(lo:read(10))
+
+	lo:seek("set")
+	local chunks = {}
+	for chunk in lo:chunks(4096) do
+		table.insert(chunks, chunk)
+	end
+	assert.equals(3, #chunks)
+	assert.equals(data, table.concat(chunks))
+
+	assert.is_true(lo:truncate(5))
+	lo:seek("set")
+	assert.equals("01234", lo:read(100))
+
+	assert.is_true(lo:close())
+	assert.has_error(function()
+		lo:read(1)
+	end)
+
+	assert.is_true(dbh:lo_unlink(oid))
+
+end
+
+
+local function test_postgres_array_params()
+
+	local sth = assert(dbh:prepare("select name from select_tests where id = any($1::int[]) order by id"))
+
+	-- one prepared statement serves any number of values
+	assert.is_true(sth:execute({1, 2}))
+	assert.equals('Row 1', sth:fetch()[1])
+	assert.equals('Row 2', sth:fetch()[1])
+	assert.is_nil(sth:fetch())
+
+	assert.is_true(sth:execute({}))
+	assert.is_nil(sth:fetch())
+	sth:close()
+
+	sth = assert(dbh:prepare("select $1::text[]"))
+	assert.is_true(sth:execute({ 'a "quoted" string', 'back\\slash', 'NULL' }))
+	assert.equals('{"a \\"quoted\\" string","back\\\\slash","NULL"}', sth:fetch()[1])
+	sth:close()
+
+	sth = assert(dbh:prepare("select $1::int[]"))
+	assert.is_true(sth:execute({ {1, 2}, {3, 4} }))
+	assert.equals('{{1,2},{3,4}}', sth:fetch()[1])
+
+	local ok = sth:execute({ function() end })
+	assert.is_false(ok)
+	sth:close()
+
+end
+
+
+local function test_postgres_timeout()
+
+	local sth = assert(dbh:prepare("select pg_sleep($1)"))
+	assert.equals(0, sth:timeout(200))
+
+	local ok, err = sth:execute(5)
+	assert.is_false(ok)
+	assert.truthy(err:find("timed out"))
+
+	-- the connection is usable again straight away
+	assert.is_true(sth:execute(0))
+	assert.equals(200, sth:timeout(0))
+	sth:close()
+
+	-- cancelling an asynchronous statement
+	sth = assert(dbh:prepare("select pg_sleep(5)"))
+	assert.is_true(sth:execute_async())
+	assert.is_true(dbh:cancel())
+
+	local ready, wait
+	repeat
+		ready, wait = sth:poll()
+	until ready ~= false
+	assert.is_nil(ready)
+	sth:close()
+
+end
+
+
+local function test_postgres_last_id()
+
+	local sth = assert(dbh:prepare(code('insert_returning')))
+
+	-- the RETURNING row comes straight back from execute_returning
+	local row = assert(sth:execute_returning(os.date()))
+	local id = row[1]
+	assert.is_not_nil(id)
+
+	assert.equals(id, dbh:last_id())
+	assert.equals(id, dbh:last_id())
+
+	row = assert(sth:execute_returning(os.date()))
+	assert.equals(id + 1, row[1])
+	assert.equals(row[1], dbh:last_id())
+	sth:close()
+
+	-- statements returning no rows give nil
+	sth = assert(dbh:prepare(code('insert_select')))
+	assert.is_nil(sth:execute_returning(-1))
+	sth:close()
+
+	-- and errors nil plus a message
+	sth = assert(dbh:prepare("select 1 / $1"))
+	local ok, err = sth:execute_returning(0)
+	assert.is_nil(ok)
+	assert.is_string(err)
+	sth:close()
+
+end
+
+
+local function test_postgres_connect_options()
+
+	local dbh2, err = DBI.Connect(db_type, {
+		conninfo = "dbname=" .. config.connect.name,
+		user = config.connect.user,
+		password = config.connect.pass,
+		host = config.connect.host,
+		port = config.connect.port,
+		keepalives = true,
+		connect_timeout = 5,
+		application_name = "luadbi tests",
+		autocommit = true
+	})
+
+	assert.is_nil(err)
+	assert.is_true(dbh2:ping())
+
+	-- no BEGIN was sent
+	local sth = assert(dbh2:prepare("select current_setting('application_name'), now() = statement_timestamp()"))
+	assert.is_true(sth:execute())
+	local row = sth:fetch()
+	assert.equals("luadbi tests", row[1])
+	assert.is_true(row[2])
+	sth:close()
+	dbh2:close()
+
+	dbh2, err = DBI.Connect(db_type, { host = config.connect.host, bogus_keyword = 1 })
+	assert.is_nil(dbh2)
+	assert.is_string(err)
+
+end
+
+
+local function test_mysql_long_values()
+
+	local sth = assert(dbh:prepare("select id, repeat(name, ?) from select_tests order by id"))
+
+	-- values beyond the preallocated buffers, in several rows
+	for _, n in ipairs({ 1, 2000, 10 }) do
+		assert.is_true(sth:execute(n))
+
+		local count = 0
+		for row in sth:rows() do
+			count = count + 1
+			assert.equals(string.rep("Row " .. row[1], n), row[2])
+		end
+		assert.is_true(count > 1)
+	end
+
+	sth:close()
+
+end
+
+
+local function test_mysql_stream()
+
+	local expected = {}
+	local sth = assert(dbh:prepare("select id, name from select_tests order by id"))
+	assert.is_true(sth:execute())
+	for row in sth:rows() do
+		table.insert(expected, row[2])
+	end
+	sth:close()
+
+	for _, options in ipairs({ { stream = true }, { prefetch_rows = 2 } }) do
+		sth = assert(dbh:prepare("select id, name from select_tests order by id", options))
+
+		-- twice, to check the statement can be reused
+		for _ = 1, 2 do
+			assert.is_true(sth:execute())
+
+			local names = {}
+			for row in sth:rows() do
+				table.insert(names, row[2])
+			end
+			assert.same(expected, names)
+		end
+
+		sth:close()
+	end
+
+	-- an abandoned stream is discarded by the next execute
+	sth = assert(dbh:prepare("select id from select_tests order by id", { stream = true }))
+	assert.is_true(sth:execute())
+	assert.equals(1, sth:fetch()[1])
+	assert.is_true(sth:execute())
+	assert.equals(1, sth:fetch()[1])
+	sth:close()
+
+end
+
+
+local function test_mysql_types()
+
+	local sth = assert(dbh:prepare([[
+		select
+			cast(? as signed),
+			cast(4294967295 as unsigned),
+			cast(-128 as signed),
+			cast(12.50 as decimal(10, 2)),
+			cast('2001-02-03 04:05:06' as datetime),
+			cast('2001-02-03' as date),
+			cast('-01:02:03' as time)
+	]]))
+
+	-- 64 bit values round trip exactly
+	assert.is_true(sth:execute(math.tointeger and math.tointeger(2^53) + 1 or 2^53))
+	local row = sth:fetch()
+	if math.tointeger then
+		assert.equals(math.tointeger(2^53) + 1, row[1])
+	end
+	assert.equals(4294967295, row[2])
+	assert.equals(-128, row[3])
+	assert.equals('12.50', row[4])
+	assert.equals('2001-02-03 04:05:06', row[5])
+	assert.equals('2001-02-03', row[6])
+	assert.equals('-01:02:03', row[7])
+	sth:close()
+
+	sth = assert(dbh:prepare([[
+		select
+			cast('2001-02-03 04:05:06' as datetime),
+			cast('2001-02-03' as date),
+			cast('-01:02:03' as time),
+			cast(12.50 as decimal(10, 2))
+	]], { datetime = "epoch", decimal = "number" }))
+
+	assert.is_true(sth:execute())
+	row = sth:fetch()
+	assert.equals(981173106, row[1])
+	assert.equals(981158400, row[2])
+	assert.equals(-3723, row[3])
+	assert.equals(12.5, row[4])
+	sth:close()
+
+end
+
+
+local function test_mysql_executemany()
+
+	local marker = "executemany " .. os.time()
+	local sth = assert(dbh:prepare("insert into insert_tests ( val ) values ( ? )"))
+
+	-- more than one batch of the multi-row fallback
+	local rows = {}
+	for i = 1, 250 do
+		rows[i] = { marker }
+	end
+
+	assert.equals(250, sth:executemany(rows))
+	assert.equals(250, sth:executemany(rows))
+
+	-- every row needs a value for each parameter
+	rows[50] = {}
+	local ok, err = pcall(sth.executemany, sth, rows)
+	assert.is_false(ok)
+	assert.matches("row 50 has 0 values, expected 1", err, 1, true)
+	rows[50] = { marker, marker }
+	assert.has_error(function()
+		sth:executemany(rows)
+	end)
+
+	-- mixed types are not sent as MariaDB arrays
+	assert.equals(2, sth:executemany({ { marker }, { 42 } }))
+	assert.equals(0, sth:executemany({}))
+	sth:close()
+
+	sth = assert(dbh:prepare("select count(*) from insert_tests where val = ?"))
+	assert.is_true(sth:execute(marker))
+	assert.equals(501, sth:fetch()[1])
+	sth:close()
+
+	assert.has_error(function()
+		dbh:prepare("select ?"):executemany({ 1 })
+	end)
+
+end
+
+
+local function test_mysql_load_data()
+
+	local marker = "load_data " .. os.time()
+	local count = assert(dbh:prepare("select count(*) from insert_tests where val = ?"))
+	local options = { columns = { "val" } }
+
+	assert.equals(2, dbh:load_data("insert_tests", marker .. "\n" .. marker .. "\n", options))
+
+	local chunks = { marker .. "\n", marker, "\n" }
+	local i = 0
+	assert.equals(2, dbh:load_data("insert_tests", function()
+		i = i + 1
+		return chunks[i]
+	end, options))
+
+	local rows = {}
+	for n = 1, 1000 do
+		rows[n] = { marker }
+	end
+	rows[1000] = { nil }
+	assert.equals(1000, dbh:load_data("insert_tests", rows, options))
+
+	assert.is_true(count:execute(marker))
+	assert.equals(1003, count:fetch()[1])
+
+	local quoted = "tab\tline\nslash\\"
+	assert.equals(1, dbh:load_data("insert_tests", { { quoted } }, options))
+	assert.is_true(count:execute(quoted))
+	assert.equals(1, count:fetch()[1])
+	count:close()
+
+	local res, err = dbh:load_data("insert_tests", function() error("source failed") end, options)
+	assert.is_nil(res)
+	assert.is_string(err)
+
+end
+
+
+local function test_mysql_multi_results()
+
+	local sth = assert(dbh:prepare("call multi_results()"))
+	assert.is_true(sth:execute())
+	assert.same({ 1 }, sth:fetch())
+	assert.is_nil(sth:fetch())
+
+	assert.is_true(sth:next_result())
+	assert.same({ 2, "two" }, sth:fetch())
+	assert.is_false(sth:next_result())
+	sth:close()
+
+	local marker = "exec_script " .. os.time()
+	assert.is_true(dbh:exec_script(
+		"insert into insert_tests ( val ) values ( '" .. marker .. "' );" ..
+		"select 1;" ..
+		"insert into insert_tests ( val ) values ( '" .. marker .. "' )"
+	))
+
+	sth = assert(dbh:prepare("select count(*) from insert_tests where val = ?"))
+	assert.is_true(sth:execute(marker))
+	assert.equals(2, sth:fetch()[1])
+	sth:close()
+
+	local ok, err = dbh:exec_script("select 1; select * from no_such_table; select 2")
+	assert.is_false(ok)
+	assert.is_string(err)
+	assert.is_true(dbh:ping())
+
+end
+
+
+local function test_mysql_async()
+
+	local DBD = require "dbd.mysql"
+
+	-- only available with MariaDB Connector/C
+	if not DBD.NewAsync then
+		return
+	end
+
+	local dbh2, err = DBD.NewAsync(
+		config.connect.name,
+		config.connect.user,
+		config.connect.pass,
+		config.connect.host,
+		config.connect.port
+	)
+	local ready, wait
+
+	assert.is_nil(err)
+	repeat ready, wait = dbh2:connect_poll() until ready ~= false
+	assert.is_nil(wait)
+	assert.is_true(ready)
+	assert.is_number(dbh2:socket())
+
+	local sth = assert(dbh2:prepare("select name from select_tests where name = ?"))
+	assert.is_true(sth:execute_async("Row 1"))
+
+	-- results are not available until the statement has completed
+	assert.has_error(function()
+		sth:fetch()
+	end)
+
+	repeat ready, err = sth:poll() until ready ~= false
+	assert.is_nil(err)
+	assert.is_true(ready)
+	assert.same({ "Row 1" }, sth:fetch())
+	sth:close()
+
+	sth = assert(dbh2:prepare("select name from select_tests where name = ?", { stream = true }))
+	assert.is_true(sth:execute_async("Row 2"))
+	repeat ready, err = sth:poll() until ready ~= false
+	assert.is_true(ready)
+
+	local row
+	assert.is_true(sth:fetch_async(true))
+	repeat ready, row = sth:poll() until ready ~= false
+	assert.is_true(ready)
+	assert.equals("Row 2", row.name)
+
+	assert.is_true(sth:fetch_async())
+	repeat ready, row = sth:poll() until ready ~= false
+	assert.is_true(ready)
+	assert.is_nil(row)
+	sth:close()
+
+	dbh2:close()
+
+end
+
+
+local function test_mysql_read_column()
+
+	local long = string.rep("0123456789", 10000)
+	local sth = assert(dbh:prepare("select ?, ?, null", { deferred = { 2, 3 } }))
+
+	assert.is_true(sth:execute(1, long))
+	local row = sth:fetch()
+	assert.equals(1, row[1])
+	assert.is_nil(row[2])
+
+	local data, length = sth:read_column(2, 5, 10)
+	assert.equals("5678901234", data)
+	assert.equals(#long, length)
+	assert.equals("", sth:read_column(2, #long, 10))
+	assert.is_nil(sth:read_column(3, 0, 10))
+
+	local chunks = {}
+	for chunk in sth:column_chunks(2, 4096) do
+		assert.is_true(#chunk <= 4096)
+		table.insert(chunks, chunk)
+	end
+	assert.equals(long, table.concat(chunks))
+
+	-- columns fetched as usual can be read the same way
+	assert.equals("1", sth:read_column(1, 0, 10))
+	sth:close()
+
+	assert.has_error(function()
+		dbh:prepare("select 1", { deferred = { 2 } })
+	end)
+
+end
+
+
+local function test_mysql_connect_options()
+
+	local dbh2, err = DBI.Connect(db_type, {
+		dbname = config.connect.name,
+		user = config.connect.user,
+		password = config.connect.pass,
+		host = config.connect.host,
+		port = config.connect.port,
+		compress = true,
+		connect_timeout = 5,
+		read_timeout = 30,
+		write_timeout = 30,
+		reconnect = false,
+		init_command = "SET @luadbi_test = 'connected'",
+		autocommit = true
+	})
+
+	assert.is_nil(err)
+	assert.is_true(dbh2:ping())
+
+	local sth = assert(dbh2:prepare("select @luadbi_test, @@autocommit"))
+	assert.is_true(sth:execute())
+	local row = sth:fetch()
+	assert.equals("connected", row[1])
+	assert.equals(1, row[2])
+	sth:close()
+
+	sth = assert(dbh2:prepare("show session status like 'Compression'"))
+	assert.is_true(sth:execute())
+	assert.equals("ON", sth:fetch()[2])
+	sth:close()
+	dbh2:close()
+
+	assert.has_error(function()
+		DBI.Connect(db_type, { dbname = config.connect.name, bogus_option = 1 })
+	end)
+
+	-- the autocommit mode outlives a reconnect
+	dbh2 = assert(DBI.Connect(db_type, {
+		dbname = config.connect.name,
+		user = config.connect.user,
+		password = config.connect.pass,
+		host = config.connect.host,
+		port = config.connect.port,
+		reconnect = true
+	}))
+	assert.is_true(dbh2:autocommit(true))
+
+	sth = assert(dbh2:prepare("select connection_id()"))
+	assert.is_true(sth:execute())
+	local id = sth:fetch()[1]
+	sth:close()
+
+	assert.is_true(dbh:exec_script("KILL " .. id))
+	dbh2:ping()
+
+	sth = assert(dbh2:prepare("select connection_id(), @@autocommit"))
+	assert.is_true(sth:execute())
+	row = sth:fetch()
+	assert.are_not.equal(id, row[1])
+	assert.equals(1, row[2])
+	sth:close()
+	dbh2:close()
+
+end
+
+
+local function test_mysql_metadata_cache()
+
+	-- the result buffers of the first execute are reused
+	local sth = assert(dbh:prepare("select name, flag from select_tests where name = ?"))
+	for _, name in ipairs({ "Row 1", "Row 2", "Row 1" }) do
+		assert.is_true(sth:execute(name))
+		assert.equals(name, sth:fetch(true).name)
+	end
+
+	-- a failed execute leaves nothing to fetch
+	assert.is_false(sth:execute())
+	assert.has_error(function()
+		sth:fetch()
+	end)
+	sth:close()
+
+	-- after moving through the results of a CALL, the next execute
+	-- describes its first result again
+	sth = assert(dbh:prepare("call multi_results()"))
+	for _ = 1, 2 do
+		assert.is_true(sth:execute())
+		assert.same({ 1 }, sth:fetch())
+		assert.is_true(sth:next_result())
+		assert.same({ 2, "two" }, sth:fetch())
+		assert.is_false(sth:next_result())
+	end
+	sth:close()
+
+end
+
+
+local function test_sqlite_open_options()
+
+	local path = os.tmpname()
+	local calls = 0
+	local dbh2, err = DBI.Connect(db_type, path, nil, {
+		busy_handler = function(count)
+			calls = count + 1
+			return count < 2
+		end,
+		journal_mode = "wal",
+		synchronous = "normal",
+		cache_size = -4096,
+		temp_store = 2,
+		pragmas = { foreign_keys = true }
+	})
+
+	assert.is_nil(err)
+
+	local function pragma(conn, name)
+		local sth = assert(conn:prepare("pragma " .. name))
+		assert.is_true(sth:execute())
+		local value = sth:fetch()[1]
+		sth:close()
+		return value
+	end
+
+	assert.equals("wal", pragma(dbh2, "journal_mode"))
+	assert.equals(1, pragma(dbh2, "synchronous"))
+	assert.equals(-4096, pragma(dbh2, "cache_size"))
+	assert.equals(2, pragma(dbh2, "temp_store"))
+	assert.equals(1, pragma(dbh2, "foreign_keys"))
+
+	local dbh3 = assert(DBI.Connect(db_type, path, { busy_timeout = 10 }))
+	local sth = assert(dbh3:prepare("create table locked (id integer)"))
+	assert.is_true(sth:execute())
+	sth:close()
+	assert.is_true(dbh3:commit())
+
+	-- dbh3 holds the write lock until it commits, so the handler gives up
+	sth = assert(dbh3:prepare("insert into locked values (1)"))
+	assert.is_true(sth:execute())
+	sth:close()
+
+	sth = assert(dbh2:prepare("insert into locked values (2)"))
+	assert.is_false(sth:execute())
+	sth:close()
+	assert.equals(3, calls)
+
+	assert.is_true(dbh3:close())
+	assert.is_true(dbh2:close())
+	os.remove(path)
+	os.remove(path .. "-wal")
+	os.remove(path .. "-shm")
+
+	assert.has_error(function()
+		DBI.Connect(db_type, path, nil, { pragmas = { ["x; drop table y"] = 1 } })
+	end)
+	os.remove(path)
+
+end
+
+
+local function test_sqlite_blob()
+
+	local blob = assert(dbh:blob_open("blob_tests", "data", 1, true))
+	assert.equals(16, blob:size())
+	assert.is_true(blob:write("abcd"))
+	assert.is_true(blob:write("wxyz", 12))
+	assert.is_false(blob:write("too long", 12))
+	assert.equals("abcd", blob:read(4))
+	assert.equals("yz", blob:read(8, 14))
+	assert.is_nil(blob:read(1, 16))
+
+	assert.is_true(blob:reopen(2))
+	assert.equals(4, blob:size())
+	assert.equals("\1\2\3", blob:read(3, 1))
+	assert.is_true(blob:close())
+
+	assert.has_error(function()
+		blob:read(1)
+	end)
+
+	local _, err = dbh:blob_open("blob_tests", "data", 3)
+	assert.is_string(err)
+
+	local sth = assert(dbh:prepare("select substr(data, 13) from blob_tests where id = 1"))
+	assert.is_true(sth:execute())
+	assert.equals("wxyz", sth:fetch()[1])
+	sth:close()
+
+	-- closing the connection closes its open blobs
+	local dbh2 = assert(DBI.Connect(db_type, config.connect.name))
+	blob = assert(dbh2:blob_open("blob_tests", "data", 2))
+	assert.is_true(dbh2:close())
+	assert.is_false(blob:close())
+
+	assert.has_error(function()
+		blob:read(1)
+	end)
+
+end
+
+
+local function test_sqlite_functions()
+
+	local DBD = require "dbd.sqlite3"
+	local calls = 0
+	assert.is_true(dbh:create_function("lua_double", 1, function(x)
+		calls = calls + 1
+		if x == nil then
+			return nil
+		end
+		return x * 2
+	end, DBD.SQLITE_DETERMINISTIC))
+
+	assert.is_true(dbh:create_function("lua_fail", -1, function()
+		error("function failed")
+	end))
+
+	assert.is_true(dbh:create_aggregate("lua_concat", function(state, name)
+		state = state or {}
+		state[#state + 1] = name
+		return state
+	end, function(state)
+		return state and table.concat(state, ",")
+	end, 1))
+
+	assert.is_true(dbh:create_aggregate("lua_count", function(n)
+		return (n or 0) + 1
+	end))
+
+	local sth = assert(dbh:prepare("select lua_double(maths), lua_double(null) from select_tests where lua_double(id) = 4"))
+	assert.is_true(sth:execute())
+	assert.same({ 108642 }, sth:fetch())
+	sth:close()
+	assert.is_true(calls > 0)
+
+	sth = assert(dbh:prepare("select lua_concat(name), lua_count(*) from select_tests where id < 3"))
+	assert.is_true(sth:execute())
+	assert.same({ "Row 1,Row 2", 2 }, sth:fetch())
+	sth:close()
+
+	sth = assert(dbh:prepare("select lua_concat(name) from select_tests where id < 0"))
+	assert.is_true(sth:execute())
+	assert.same({}, sth:fetch())
+	sth:close()
+
+	sth = assert(dbh:prepare("select lua_fail(1, 2)"))
+	assert.is_false(sth:execute())
+	sth:close()
+
+end
+
+
+local function test_sqlite_backup()
+
+	local path = os.tmpname()
+	local steps, total = 0, nil
+	local ok, err = dbh:backup_to(path, 1, 0, function(remaining, pages)
+		steps = steps + 1
+		total = pages
+		assert.is_true(remaining < pages)
+	end)
+
+	assert.is_nil(err)
+	assert.is_true(ok)
+	assert.equals(total, steps)
+
+	local dbh2 = assert(DBI.Connect(db_type, ":memory:"))
+	assert.is_true(dbh:backup_to(dbh2))
+
+	local sth = assert(dbh2:prepare("select count(*) from select_tests"))
+	assert.is_true(sth:execute())
+	assert.same({ 3 }, sth:fetch())
+	sth:close()
+
+	-- in-memory databases can be saved to disk the same way
+	assert.is_true(dbh2:backup_to(path))
+	dbh2:close()
+
+	dbh2 = assert(DBI.Connect(db_type, path))
+	sth = assert(dbh2:prepare("select name from select_tests where id = 2"))
+	assert.is_true(sth:execute())
+	assert.same({ "Row 2" }, sth:fetch())
+	sth:close()
+	dbh2:close()
+
+	ok, err = dbh:backup_to(path, 1, 0, function() return false end)
+	assert.is_false(ok)
+	assert.is_string(err)
+
+	os.remove(path)
+
+end
+
+
+local function test_stream_params()
+
+	local parts = { "streamed ", "", "value ", tostring(os.time()) }
+	local i = 0
+	local stream = DBI.stream(function()
+		i = i + 1
+		return parts[i]
+	end)
+	local value = table.concat(parts)
+
+	local sth = assert(dbh:prepare("insert into insert_tests ( val ) values ( ? )"))
+	assert.is_true(sth:execute(stream))
+
+	local ok, err = sth:execute(DBI.stream(function() error("reader failed") end))
+	assert.is_false(ok)
+	assert.is_string(err)
+	sth:close()
+
+	-- SQLite stores streams as blobs, which don't compare equal to text
+	sth = assert(dbh:prepare("select val from insert_tests order by id desc limit 1"))
+	assert.is_true(sth:execute())
+	assert.equals(value, sth:fetch()[1])
+	sth:close()
+
+end
+
+
+local function test_postgres_stream_params()
+
+	local data = string.rep("0123456789", 10000)
+	local offset = 0
+	local stream = DBI.stream(function()
+		if offset < #data then
+			offset = offset + 4096
+			return data:sub(offset - 4095, offset)
+		end
+	end)
+
+	-- the value is written to a new large object, and its OID bound
+	local sth = assert(dbh:prepare("select $1::oid"))
+	assert.is_true(sth:execute(stream))
+	local oid = sth:fetch()[1]
+	sth:close()
+
+	dbh:autocommit(false)
+	finally(function() dbh:autocommit(true) end)
+
+	local lo = assert(dbh:lo_open(oid, "r"))
+	assert.equals(data, lo:read(#data + 1))
+	lo:close()
+	assert.is_true(dbh:lo_unlink(oid))
+
+end
+
+
 local function test_must_execute_before_fetch()
 
 	sth = dbh:prepare("select 1;")
@@ -681,9 +1694,19 @@ describe("PostgreSQL #psql", function()
 	it( "Tests inserts", test_insert_returning )
 	it( "Tests inserts of NULL", test_insert_null_returning )
 	it( "Tests statement reuse", test_insert_multi )
-	it( "Tests no insert_id", test_no_insert_id )
+	it( "Tests last_id and execute_returning", test_postgres_last_id )
 	it( "Tests affected rows", test_update )
 	it( "Tests for prepared statement leak", test_postgres_statement_leak )
+	it( "Tests COPY TO STDOUT streaming", test_postgres_copy_out )
+	it( "Tests server side cursors", test_postgres_cursor )
+	it( "Tests asynchronous execution", test_postgres_async )
+	it( "Tests LISTEN/NOTIFY", test_postgres_notify )
+	it( "Tests prepared statement reuse", test_postgres_statement_cache )
+	it( "Tests large object streaming", test_postgres_large_object )
+	it( "Tests array parameters", test_postgres_array_params )
+	it( "Tests statement timeout and cancel", test_postgres_timeout )
+	it( "Tests connection keywords", test_postgres_connect_options )
+	it( "Tests streamed parameters", test_postgres_stream_params )
 	it( "Tests closing dbh doesn't segfault", test_db_close_doesnt_segfault )
 	it( "Tests must execute before fetch", test_must_execute_before_fetch )
 	teardown(teardown_tests)
@@ -706,6 +1729,11 @@ describe("SQLite3 #sqlite3", function()
 	it( "Tests statement reuse", test_insert_multi )
 	it( "Tests no rowcount", test_no_rowcount )
 	it( "Tests affected rows", test_update )
+	it( "Tests open options", test_sqlite_open_options )
+	it( "Tests incremental blob I/O", test_sqlite_blob )
+	it( "Tests SQL functions", test_sqlite_functions )
+	it( "Tests online backup", test_sqlite_backup )
+	it( "Tests streamed parameters", test_stream_params )
 	it( "Tests closing dbh doesn't segfault", test_db_close_doesnt_segfault )
 	it( "Tests must execute before fetch", test_must_execute_before_fetch )
 	teardown(teardown_tests)
@@ -728,6 +1756,17 @@ describe("MySQL #mysql", function()
 	it( "Tests inserts of NULL", test_insert_null )
 	it( "Tests statement reuse", test_insert_multi )
 	it( "Tests affected rows", test_update )
+	it( "Tests long values", test_mysql_long_values )
+	it( "Tests streamed results", test_mysql_stream )
+	it( "Tests result types", test_mysql_types )
+	it( "Tests executemany", test_mysql_executemany )
+	it( "Tests load_data", test_mysql_load_data )
+	it( "Tests multiple result sets", test_mysql_multi_results )
+	it( "Tests asynchronous execution", test_mysql_async )
+	it( "Tests reading columns in pieces", test_mysql_read_column )
+	it( "Tests connection options", test_mysql_connect_options )
+	it( "Tests result metadata reuse", test_mysql_metadata_cache )
+	it( "Tests streamed parameters", test_stream_params )
 	it( "Tests closing dbh doesn't segfault", test_db_close_doesnt_segfault )
 	it( "Tests must execute before fetch", test_must_execute_before_fetch )
 	teardown(teardown_tests)
@@ -89,3 +89,14 @@ insert into update_tests
 	);
 
 grant select, update on update_tests to 'luadbi'@'%';
+
+drop procedure if exists multi_results;
+delimiter //
+create procedure multi_results()
+	begin
+		select 1;
+		select 2, 'two';
+	end//
+delimiter ;
+
+grant execute on procedure multi_results to 'luadbi'@'%';
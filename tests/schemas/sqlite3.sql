@@ -83,3 +83,25 @@ insert into update_tests
 		'now',
 		1
 	);
+
+drop table if exists blob_tests;
+create table blob_tests
+	(
+		id integer primary key,
+		data blob not null
+	);
+
+insert into blob_tests
+	(
+		id,
+		data
+	)
+	values
+	(
+		1,
+		zeroblob(16)
+	),
+	(
+		2,
+		x'00010203'
+	);